@@ -0,0 +1,109 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk { // {{{
+	arena_chunk* prev;
+	size_t size;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+}; // }}}
+
+arena* arena_init(arena* a, size_t chunk_size) { // {{{
+	memset(a, 0, sizeof(*a));
+	a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+	return a;
+} // }}}
+
+arena* arena_destroy(arena* a) { // {{{
+
+	arena_chunk* c = a->chunk;
+
+	while (c) {
+		arena_chunk* prev = c->prev;
+		free(c);
+		c = prev;
+	}
+
+	return arena_init(a, a->chunk_size);
+} // }}}
+
+static arena_chunk* arena_chunk_new(size_t size) { // {{{
+	arena_chunk* c = (arena_chunk*)malloc(sizeof(arena_chunk) + size);
+	c->size = size;
+	return c;
+} // }}}
+
+void* arena_alloc(arena* a, size_t size) { // {{{
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (size > (size_t)(a->end - a->next)) {
+
+		/* Big allocations get a chunk of their own, behind the current
+		 * one, so its free space is not wasted. */
+		if (a->chunk && (size > a->chunk_size / 4)) {
+			arena_chunk* c = arena_chunk_new(size);
+			c->prev = a->chunk->prev;
+			a->chunk->prev = c;
+			a->used += size;
+			a->last = NULL;
+			return c->data;
+		}
+
+		arena_chunk* c = arena_chunk_new(size > a->chunk_size ? size : a->chunk_size);
+		c->prev = a->chunk;
+		a->chunk = c;
+		a->next = c->data;
+		a->end = c->data + c->size;
+	}
+
+	void* p = a->next;
+	a->next += size;
+	a->used += size;
+	a->last = p;
+
+	return p;
+} // }}}
+
+void* arena_calloc(arena* a, size_t size) { // {{{
+	return memset(arena_alloc(a, size), 0, size);
+} // }}}
+
+char* arena_strdup(arena* a, const char* s) { // {{{
+	size_t len = strlen(s) + 1;
+	return (char*)memcpy(arena_alloc(a, len), s, len);
+} // }}}
+
+void arena_release(arena* a, void* p) { // {{{
+
+	if (!p || (p != a->last))
+		return;
+
+	a->used -= a->next - (char*)p;
+	a->next = (char*)p;
+	a->last = NULL;
+
+} // }}}
@@ -0,0 +1,57 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_ARENA_H
+#define __FILEDEDUP_ARENA_H
+
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * Bump allocator: memory is carved out of big chunks, and only given
+ * back all at once by arena_destroy().  Each step of the run allocates
+ * its files, clusters and keys from an arena of its own.
+ *
+ * Not thread safe (the step arena is used with the state lock held).
+ *
+ */
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct arena {
+	arena_chunk* chunk;   /** current chunk, linked to the older ones */
+	char* next;           /** free space of the current chunk         */
+	char* end;
+	void* last;           /** last allocation, see arena_release()    */
+	size_t chunk_size;
+	size_t used;          /** bytes handed out                        */
+} arena;
+
+#define ARENA_CHUNK_SIZE (1024*1024)
+
+arena* arena_init(arena* a, size_t chunk_size);  /** 0: ARENA_CHUNK_SIZE */
+arena* arena_destroy(arena* a);                  /** frees every allocation */
+
+void* arena_alloc(arena* a, size_t size);        /** 16 bytes aligned */
+void* arena_calloc(arena* a, size_t size);
+char* arena_strdup(arena* a, const char* s);
+void arena_release(arena* a, void* p);           /** undoes p, if it was the last allocation */
+
+#endif
@@ -0,0 +1,367 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define _GNU_SOURCE
+#include "catalog.h"
+#include "discriminant.h"
+#include "htable.h"
+#include "error.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CATALOG_MAGIC      "FDDCAT02"
+#define CATALOG_MAGIC_LEN  8
+#define CATALOG_HEADER_LEN 16   /* magic, then the number of the last run */
+
+#define CATALOG_IDLE_RUNS     8  /* records unused for this many runs are dropped */
+#define CATALOG_REFRESH_RUNS  4  /* hits on records this old append a fresh copy */
+
+typedef struct catalog_rec {
+	/* lookup key */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t end;
+	uint64_t methods;    /** DISC_* content methods of the step */
+
+	/* the digests hold while these are unchanged */
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	int64_t ctime;
+	int64_t ctime_nsec;
+
+	uint64_t run;        /** last run that stored or refreshed it */
+	uint64_t len;        /** digest bytes that follow, see digest_pack() */
+} catalog_rec;
+
+#define REC_KEY_LEN    offsetof(catalog_rec, size)
+#define REC_SIZE(len)  (sizeof(catalog_rec) + (((len) + 7) & ~7ULL))
+#define REC_DATA(r)    ((unsigned char*)((r) + 1))
+
+static struct {
+	int fd;                 /** -1: no catalog */
+	char* path;
+
+	char* map;              /** the catalog as it was at start up */
+	size_t maplen;
+
+	htable index;           /** key: a record's first REC_KEY_LEN bytes, value: the record */
+	catalog_rec** newv;     /** records appended in this run */
+	size_t newc;
+	size_t newv_size;
+
+	size_t live;
+	size_t dead;            /** records superseded by newer ones */
+	size_t hits;
+	uint64_t run;           /** this run's number */
+
+	pthread_mutex_t lock;
+} _cat = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void catalog_index(catalog_rec* r) { // {{{
+
+	void* old = NULL;
+	size_t oldlen = 0;
+
+	if (htable_unset(&_cat.index, r, REC_KEY_LEN, &old, &oldlen) == HTABLE_FOUND) {
+		++_cat.dead;
+		--_cat.live;
+	}
+
+	htable_add(&_cat.index, r, REC_KEY_LEN, r, sizeof(*r));
+	++_cat.live;
+
+} // }}}
+
+void catalog_open(const char* path) { // {{{
+
+	struct stat st;
+
+	_cat.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (_cat.fd < 0)
+		fatal("Could not open catalog \"%s\": %s.\n", path, strerror(errno));
+
+	if (fstat(_cat.fd, &st) < 0)
+		fatal("Could not stat catalog \"%s\": %s.\n", path, strerror(errno));
+
+	_cat.path = strdup(path);
+	htable_init(&_cat.index, 0);
+
+	char header[CATALOG_HEADER_LEN];
+
+	if (st.st_size == 0) {
+		_cat.run = 1;
+		memcpy(header, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+		memcpy(header + CATALOG_MAGIC_LEN, &_cat.run, sizeof(_cat.run));
+
+		if (write(_cat.fd, header, sizeof(header)) != sizeof(header))
+			fatal("Could not write catalog \"%s\": %s.\n", path, strerror(errno));
+		return;
+	}
+
+	if ((pread(_cat.fd, header, sizeof(header), 0) != sizeof(header)) ||
+	    memcmp(header, CATALOG_MAGIC, CATALOG_MAGIC_LEN))
+		fatal("\"%s\" is not a filededup catalog.\n", path);
+
+	memcpy(&_cat.run, header + CATALOG_MAGIC_LEN, sizeof(_cat.run));
+	++_cat.run;
+
+	/* pwrite(2) ignores the offset on an O_APPEND fd */
+	int hfd = open(path, O_WRONLY | O_CLOEXEC);
+	if ((hfd < 0) || (pwrite(hfd, &_cat.run, sizeof(_cat.run), CATALOG_MAGIC_LEN) != sizeof(_cat.run)))
+		fatal("Could not write catalog \"%s\": %s.\n", path, strerror(errno));
+	close(hfd);
+
+	if (st.st_size == CATALOG_HEADER_LEN)
+		return;
+
+	_cat.maplen = st.st_size;
+	_cat.map = (char*)mmap(NULL, _cat.maplen, PROT_READ, MAP_SHARED, _cat.fd, 0);
+	if (_cat.map == MAP_FAILED)
+		fatal("Could not mmap catalog \"%s\": %s.\n", path, strerror(errno));
+
+	madvise(_cat.map, _cat.maplen, MADV_WILLNEED);
+
+	size_t off = CATALOG_HEADER_LEN;
+
+	while (off + sizeof(catalog_rec) <= _cat.maplen) {
+		catalog_rec* r = (catalog_rec*)(_cat.map + off);
+
+		/* padding included: the next record must start aligned */
+		if ((r->len > _cat.maplen - off) || (REC_SIZE(r->len) > _cat.maplen - off))
+			break;
+
+		catalog_index(r);
+		off += REC_SIZE(r->len);
+	}
+
+	/* an earlier run died while appending */
+	if (off != _cat.maplen) {
+		warning("Dropping a truncated record at the end of catalog \"%s\".\n", path);
+		if (ftruncate(_cat.fd, off) < 0)
+			fatal("Could not truncate catalog \"%s\": %s.\n", path, strerror(errno));
+	}
+
+	debug("catalog: %lu records (%lu superseded).\n",
+			(unsigned long)_cat.live, (unsigned long)_cat.dead);
+
+} // }}}
+
+static void catalog_key(catalog_rec* r, finfo_t* fi, struct discriminant_t* d) { // {{{
+
+	memset(r, 0, sizeof(*r));
+
+	r->dev = fi->dev;
+	r->ino = fi->ino;
+	r->end = d->end;
+	r->methods = d->methods & DISC_CONTENT_MASK;
+
+	r->size = fi->size;
+	r->mtime = fi->mtime;
+	r->mtime_nsec = fi->mtime_nsec;
+	r->ctime = fi->ctime;
+	r->ctime_nsec = fi->ctime_nsec;
+
+} // }}}
+
+/* with the lock held; r is freed by catalog_close() */
+static void catalog_append(catalog_rec* r) { // {{{
+
+	/* O_APPEND: a crash leaves at most one truncated record */
+	ssize_t nwritten = write(_cat.fd, r, REC_SIZE(r->len));
+	if (nwritten != REC_SIZE(r->len))
+		error("Could not append to catalog \"%s\": %s.\n", _cat.path,
+				nwritten < 0 ? strerror(errno) : "short write");
+
+	if (_cat.newc == _cat.newv_size) {
+		_cat.newv_size = _cat.newv_size ? 2 * _cat.newv_size : 1024;
+		_cat.newv = (catalog_rec**)realloc(_cat.newv, _cat.newv_size * sizeof(catalog_rec*));
+	}
+	_cat.newv[_cat.newc++] = r;
+
+	catalog_index(r);
+
+} // }}}
+
+int catalog_lookup(finfo_t* fi, struct discriminant_t* d, digest_t* digest) { // {{{
+
+	if ((_cat.fd < 0) || !(d->methods & DISC_CONTENT_MASK))
+		return 0;
+
+	catalog_rec key;
+	catalog_key(&key, fi, d);
+
+	void* data = NULL;
+	size_t dlen = 0;
+	int found = 0;
+
+	pthread_mutex_lock(&_cat.lock);
+
+	if (htable_find(&_cat.index, &key, REC_KEY_LEN, &data, &dlen) == HTABLE_FOUND) {
+		catalog_rec* r = (catalog_rec*)data;
+
+		/* the content may have changed */
+		found = (r->size == key.size) &&
+			(r->mtime == key.mtime) && (r->mtime_nsec == key.mtime_nsec) &&
+			(r->ctime == key.ctime) && (r->ctime_nsec == key.ctime_nsec) &&
+			(r->len == digest_pack(key.methods, NULL, NULL));
+
+		if (found) {
+			digest_unpack(key.methods, REC_DATA(r), digest);
+			++_cat.hits;
+
+			/* hit every now and then: it mustn't age out */
+			if (r->run + CATALOG_REFRESH_RUNS <= _cat.run) {
+				catalog_rec* fresh = (catalog_rec*)malloc(REC_SIZE(r->len));
+				memcpy(fresh, r, REC_SIZE(r->len));
+				fresh->run = _cat.run;
+				catalog_append(fresh);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&_cat.lock);
+
+	return found;
+} // }}}
+
+void catalog_store(finfo_t* fi, struct discriminant_t* d, digest_t* digest) { // {{{
+
+	if ((_cat.fd < 0) || !(d->methods & DISC_CONTENT_MASK))
+		return;
+
+	catalog_rec key;
+	catalog_key(&key, fi, d);
+
+	key.len = digest_pack(key.methods, NULL, NULL);
+
+	catalog_rec* r = (catalog_rec*)calloc(1, REC_SIZE(key.len));
+	*r = key;
+	r->run = _cat.run;
+	digest_pack(r->methods, digest, REC_DATA(r));
+
+	pthread_mutex_lock(&_cat.lock);
+	catalog_append(r);
+	pthread_mutex_unlock(&_cat.lock);
+
+} // }}}
+
+typedef struct compact_out {
+	int fd;
+	int failed;
+	size_t idle;   /** records dropped for not being used lately */
+} compact_out;
+
+static int catalog_write_rec(void* key, size_t keylen, void* data, size_t dlen, void* _out) { // {{{
+
+	compact_out* out = (compact_out*)_out;
+	catalog_rec* r = (catalog_rec*)data;
+
+	/* the file is gone, or no longer walked, or not with this --eval */
+	if (r->run + CATALOG_IDLE_RUNS < _cat.run) {
+		out->idle++;
+		return 0;
+	}
+
+	if (write(out->fd, r, REC_SIZE(r->len)) != REC_SIZE(r->len)) {
+		out->failed = 1;
+		return -1;
+	}
+
+	return 0;
+} // }}}
+
+/* Rewrites the catalog without superseded nor idle records */
+static void catalog_compact() { // {{{
+
+	char* tmp = NULL;
+	asprintf(&tmp, "%s.tmp", _cat.path);
+
+	compact_out out = { open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), 0, 0 };
+	if (out.fd < 0) {
+		error("Could not compact catalog into \"%s\": %s.\n", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	char header[CATALOG_HEADER_LEN];
+	memcpy(header, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+	memcpy(header + CATALOG_MAGIC_LEN, &_cat.run, sizeof(_cat.run));
+
+	int ok = write(out.fd, header, sizeof(header)) == sizeof(header);
+
+	if (ok)
+		htable_foreach(&_cat.index, catalog_write_rec, &out);
+
+	ok = ok && !out.failed && (fsync(out.fd) == 0);
+
+	if (close(out.fd) < 0)
+		ok = 0;
+
+	if (ok && (rename(tmp, _cat.path) == 0)) {
+		debug("catalog: compacted, %lu superseded and %lu idle records dropped.\n",
+				(unsigned long)_cat.dead, (unsigned long)out.idle);
+	} else {
+		error("Could not compact catalog \"%s\": %s.\n", _cat.path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+
+} // }}}
+
+void catalog_close() { // {{{
+
+	if (_cat.fd < 0)
+		return;
+
+	debug("catalog: %lu hits, %lu new records.\n",
+			(unsigned long)_cat.hits, (unsigned long)_cat.newc);
+
+	if (_cat.dead > _cat.live)
+		catalog_compact();
+
+	htable_destroy(&_cat.index);
+
+	if (_cat.map)
+		munmap(_cat.map, _cat.maplen);
+
+	size_t i = 0;
+	for (; i < _cat.newc; ++i)
+		free(_cat.newv[i]);
+	free(_cat.newv);
+
+	close(_cat.fd);
+	free(_cat.path);
+
+	_cat.fd = -1;
+
+} // }}}
@@ -0,0 +1,51 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_CATALOG_H
+#define __FILEDEDUP_CATALOG_H
+
+#include "digest.h"
+#include "finfo.h"
+
+#include <sys/stat.h>
+
+/*****************************************************
+ *
+ * Digest catalog (--catalog file): the digests computed in earlier runs,
+ * so unchanged files are not read again.
+ *
+ * Each record holds the digests of one step (same content methods and
+ * range) for one inode, and is valid as long as size, mtime and ctime
+ * are unchanged.  The file is mapped at start up; new records are
+ * appended to it.  When records superseded by newer ones outnumber the
+ * live ones, the file is rewritten without them, and without those not
+ * hit nor stored for several runs.
+ *
+ * All functions are no-ops when no catalog was opened, and may be
+ * called from several threads.
+ *
+ */
+
+void catalog_open(const char* path);
+int catalog_lookup(finfo_t* fi, struct discriminant_t* d, digest_t* digest); /** 1 if found */
+void catalog_store(finfo_t* fi, struct discriminant_t* d, digest_t* digest);
+void catalog_close();
+
+#endif
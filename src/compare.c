@@ -0,0 +1,511 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE
+#include "compare.h"
+#include "config.h"
+#include "error.h"
+#include "xxh3.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define COMPARE_MAX_BLOCK (1024*1024)
+#define COMPARE_MAX_FILES 16   /** inodes read in lockstep (fds and blocks) */
+
+typedef struct cmp_member {
+	file_t** filev;  /** paths of this inode */
+	size_t filec;
+	int fd;
+	char* buf;       /** one of the blocks of the thread */
+	char* path;      /** of filev[0] */
+	ssize_t len;     /** bytes in buf, -1 on error */
+	int cls;         /** class within the current group */
+	uint64_t digest; /** xxh3 of the contents, for big clusters */
+} cmp_member;
+
+typedef struct cmp_range {
+	size_t start;
+	size_t end;
+	off_t offset;
+} cmp_range;
+
+/* called with each group of identical members found by compare_lockstep() */
+typedef void (*cmp_emit_fn)(cmp_member** v, size_t n, void* ctx);
+
+typedef struct cmp_emit_files {
+	compare_group_fn fn;
+	void* cbdata;
+} cmp_emit_files;
+
+/* --eval=compare in big clusters: members compared against a leader */
+typedef struct cmp_leader {
+	cmp_member* leader;
+	cmp_member** groupv;   /** identical to the leader */
+	size_t groupc;
+	cmp_member** restv;    /** to be compared again, among themselves */
+	size_t restc;
+	int seen;              /** the leader could be read */
+} cmp_leader;
+
+static pthread_key_t _bufs_key;
+static pthread_once_t _bufs_once = PTHREAD_ONCE_INIT;
+
+static void compare_bufs_free(void* _bufv) { // {{{
+
+	char** bufv = (char**)_bufv;
+	size_t i;
+
+	for (i = 0; i < COMPARE_MAX_FILES; ++i)
+		free(bufv[i]);
+	free(bufv);
+} // }}}
+
+static void compare_bufs_key_init() { // {{{
+	pthread_key_create(&_bufs_key, compare_bufs_free);
+} // }}}
+
+/* block i of the calling thread, allocated once and reused from cluster
+ * to cluster; freed when the thread exits */
+static char* compare_buf(size_t i, size_t blk) { // {{{
+
+	pthread_once(&_bufs_once, compare_bufs_key_init);
+
+	char** bufv = (char**)pthread_getspecific(_bufs_key);
+	if (!bufv) {
+		bufv = (char**)calloc(COMPARE_MAX_FILES, sizeof(bufv[0]));
+		pthread_setspecific(_bufs_key, bufv);
+	}
+
+	if (!bufv[i])
+		bufv[i] = (char*)malloc(blk);
+
+	return bufv[i];
+} // }}}
+
+static int devino_cmp(const void* _a, const void* _b) { // {{{
+	const file_t* a = *(const file_t**)_a;
+	const file_t* b = *(const file_t**)_b;
+
+	if (a->fi.dev != b->fi.dev)
+		return a->fi.dev < b->fi.dev ? -1 : 1;
+
+	if (a->fi.ino != b->fi.ino)
+		return a->fi.ino < b->fi.ino ? -1 : 1;
+
+	return 0;
+} // }}}
+
+static int digest_cmp(const void* _a, const void* _b) { // {{{
+	const cmp_member* a = *(const cmp_member**)_a;
+	const cmp_member* b = *(const cmp_member**)_b;
+
+	if (a->digest != b->digest)
+		return a->digest < b->digest ? -1 : 1;
+
+	return 0;
+} // }}}
+
+static const char* member_path(cmp_member* m) { // {{{
+	if (!m->path)
+		m->path = path_dup(m->filev[0]->path);
+	return m->path;
+} // }}}
+
+static int member_open(cmp_member* m, char* buf) { // {{{
+
+	m->fd = open(member_path(m), O_RDONLY | O_CLOEXEC);
+	if (m->fd < 0) {
+		error("Could not open \"%s\": %s.\n", m->path, strerror(errno));
+		return -1;
+	}
+
+	posix_fadvise(m->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	m->buf = buf;
+
+	return 0;
+} // }}}
+
+static void member_close(cmp_member* m) { // {{{
+	if (m->fd >= 0)
+		close(m->fd);
+	m->fd = -1;
+	m->buf = NULL;
+} // }}}
+
+static void member_read(cmp_member* m, size_t blk, off_t offset) { // {{{
+
+	if (m->fd < 0) {
+		m->len = -1;
+		return;
+	}
+
+	m->len = 0;
+
+	while (m->len < blk) {
+		ssize_t nread = pread(m->fd, m->buf + m->len, blk - m->len, offset + m->len);
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			error("Error on read from %s: %s\n.", m->path, strerror(errno));
+			m->len = -1;
+			return;
+		}
+
+		if (nread == 0)
+			break;
+
+		m->len += nread;
+	}
+} // }}}
+
+/* xxh3 of the whole file, read through buf; -1 on error */
+static int member_digest(cmp_member* m, char* buf, size_t blk) { // {{{
+
+	xxh3_state_t state;
+	unsigned char out[XXH3_DIGEST_LENGTH];
+	off_t offset = 0;
+	size_t i;
+
+	if (member_open(m, buf) < 0)
+		return -1;
+
+	xxh3_init(&state);
+
+	while (1) {
+		member_read(m, blk, offset);
+		if (m->len < 0) {
+			member_close(m);
+			return -1;
+		}
+
+		xxh3_update(&state, m->buf, m->len);
+		offset += m->len;
+
+		if (m->len < blk)
+			break;
+	}
+
+	member_close(m);
+
+	xxh3_final(&state, out);
+	m->digest = 0;
+	for (i = 0; i < sizeof(out); ++i)
+		m->digest = (m->digest << 8) | out[i];
+
+	return 0;
+} // }}}
+
+/* Reads orderv[0, orderc) (open, at most COMPARE_MAX_FILES) in lockstep,
+ * and emits each group of identical ones; those that can't be read are
+ * left out. */
+static void compare_lockstep(cmp_member** orderv, size_t orderc, size_t blk, cmp_emit_fn emit, void* ctx) { // {{{
+
+	/* groups still being compared; each is a range of orderv */
+	cmp_range stackv[COMPARE_MAX_FILES + 1];
+	cmp_member* leaderv[COMPARE_MAX_FILES + 1];
+	size_t stackc = 0;
+	size_t i;
+
+	if (orderc == 1)
+		emit(orderv, 1, ctx);
+
+	else if (orderc > 1) {
+		stackv[stackc].start = 0;
+		stackv[stackc].end = orderc;
+		stackv[stackc].offset = 0;
+		stackc++;
+	}
+
+	while (stackc) {
+
+		cmp_range r = stackv[--stackc];
+		int clsc = 0;
+
+		while (1) {
+
+			for (i = r.start; i < r.end; ++i)
+				member_read(orderv[i], blk, r.offset);
+
+			/* one class per distinct block, compared against the
+			 * first member (leader) of each class */
+			clsc = 0;
+			for (i = r.start; i < r.end; ++i) {
+				cmp_member* m = orderv[i];
+				int cls = 0;
+
+				m->cls = -1;
+
+				if (m->len < 0)
+					continue;
+
+				for (; cls < clsc; ++cls) {
+					cmp_member* l = leaderv[cls];
+					if ((l->len == m->len) && !memcmp(l->buf, m->buf, m->len)) {
+						m->cls = cls;
+						break;
+					}
+				}
+
+				if (m->cls < 0) {
+					m->cls = clsc;
+					leaderv[clsc++] = m;
+				}
+			}
+
+			/* still one group, not at EOF: next block */
+			if ((clsc == 1) && (orderv[r.start]->len == blk)) {
+				int failed = 0;
+				for (i = r.start; i < r.end; ++i)
+					failed |= orderv[i]->len < 0;
+
+				if (!failed) {
+					r.offset += blk;
+					continue;
+				}
+			}
+
+			break;
+		}
+
+		/* stable partition of the range by class; read errors go last
+		 * and are dropped */
+		size_t pos = r.start;
+		int cls;
+
+		for (cls = 0; cls <= clsc; ++cls) {
+			int _cls = cls < clsc ? cls : -1;
+			size_t gstart = pos;
+			size_t j;
+
+			for (i = r.start; i < r.end; ++i) {
+				cmp_member* m = orderv[i];
+				if (m->cls != _cls)
+					continue;
+
+				/* move m to pos, shifting the ones in between */
+				for (j = i; j > pos; --j)
+					orderv[j] = orderv[j-1];
+				orderv[pos++] = m;
+			}
+
+			if (_cls < 0) {
+				for (j = gstart; j < pos; ++j)
+					member_close(orderv[j]);
+				continue;
+			}
+
+			int at_eof = orderv[gstart]->len < blk;
+
+			if ((pos - gstart == 1) || at_eof) {
+				emit(orderv + gstart, pos - gstart, ctx);
+
+			} else {
+				stackv[stackc].start = gstart;
+				stackv[stackc].end = pos;
+				stackv[stackc].offset = r.offset + blk;
+				stackc++;
+			}
+		}
+	}
+} // }}}
+
+/* opens v[0, n) with the blocks of the thread, and compares them */
+static void compare_batch(cmp_member** v, size_t n, size_t blk, cmp_emit_fn emit, void* ctx) { // {{{
+
+	cmp_member* orderv[COMPARE_MAX_FILES];
+	size_t orderc = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		if (!member_open(v[i], compare_buf(orderc, blk)))
+			orderv[orderc++] = v[i];
+
+	compare_lockstep(orderv, orderc, blk, emit, ctx);
+
+	for (i = 0; i < n; ++i)
+		member_close(v[i]);
+} // }}}
+
+static void emit_files(cmp_member** v, size_t n, void* ctx) { // {{{
+
+	cmp_emit_files* e = (cmp_emit_files*)ctx;
+	size_t filec = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		filec += v[i]->filec;
+
+	file_t** filev = (file_t**)malloc(filec * sizeof(filev[0]));
+
+	filec = 0;
+	for (i = 0; i < n; ++i) {
+		memcpy(filev + filec, v[i]->filev, v[i]->filec * sizeof(filev[0]));
+		filec += v[i]->filec;
+	}
+
+	e->fn(filev, filec, e->cbdata);
+
+	free(filev);
+} // }}}
+
+static void emit_leader(cmp_member** v, size_t n, void* ctx) { // {{{
+
+	cmp_leader* l = (cmp_leader*)ctx;
+	int with_leader = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		with_leader |= v[i] == l->leader;
+
+	l->seen |= with_leader;
+
+	for (i = 0; i < n; ++i) {
+		if (v[i] == l->leader)
+			continue;
+
+		if (with_leader)
+			l->groupv[l->groupc++] = v[i];
+		else
+			l->restv[l->restc++] = v[i];
+	}
+} // }}}
+
+/* v[0, n) share a digest, but are too many to be read in lockstep: each
+ * is compared against a leader, COMPARE_MAX_FILES - 1 at a time, and
+ * those that differ from it are compared again among themselves */
+static void compare_leader(cmp_member** v, size_t n, size_t blk, cmp_emit_fn emit, void* ctx) { // {{{
+
+	cmp_member** pendingv = (cmp_member**)malloc(n * sizeof(pendingv[0]));
+	cmp_member* batchv[COMPARE_MAX_FILES];
+	cmp_leader l;
+	size_t pendingc = n;
+	size_t i;
+
+	memcpy(pendingv, v, n * sizeof(pendingv[0]));
+
+	l.groupv = (cmp_member**)malloc(n * sizeof(l.groupv[0]));
+	l.restv = (cmp_member**)malloc(n * sizeof(l.restv[0]));
+
+	while (pendingc > COMPARE_MAX_FILES) {
+
+		l.leader = pendingv[0];
+		l.seen = 0;
+		l.groupc = 1;
+		l.groupv[0] = l.leader;
+		l.restc = 0;
+
+		for (i = 1; i < pendingc; ) {
+			size_t batchc = 1;
+
+			batchv[0] = l.leader;
+			while ((batchc < COMPARE_MAX_FILES) && (i < pendingc))
+				batchv[batchc++] = pendingv[i++];
+
+			compare_batch(batchv, batchc, blk, emit_leader, &l);
+		}
+
+		/* an unreadable leader leaves nothing to emit */
+		if (l.seen)
+			emit(l.groupv, l.groupc, ctx);
+
+		memcpy(pendingv, l.restv, l.restc * sizeof(pendingv[0]));
+		pendingc = l.restc;
+	}
+
+	compare_batch(pendingv, pendingc, blk, emit, ctx);
+
+	free(l.restv);
+	free(l.groupv);
+	free(pendingv);
+} // }}}
+
+void compare_cluster(cluster_t* cluster, compare_group_fn fn, void* cbdata) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	size_t blk = cfg->bufsize < COMPARE_MAX_BLOCK ? cfg->bufsize : COMPARE_MAX_BLOCK;
+	cmp_emit_files e = { fn, cbdata };
+	file_t** filev;
+	size_t filec = cluster->filec;
+	size_t i;
+
+	filev = (file_t**)malloc(filec * sizeof(filev[0]));
+	memcpy(filev, cluster->filev, filec * sizeof(filev[0]));
+
+	/* one member per inode */
+	qsort(filev, filec, sizeof(filev[0]), devino_cmp);
+
+	cmp_member* memberv = (cmp_member*)calloc(filec, sizeof(cmp_member));
+	cmp_member** orderv = (cmp_member**)malloc(filec * sizeof(orderv[0]));
+	size_t memberc = 0;
+	size_t orderc = 0;
+
+	for (i = 0; i < filec; ++i) {
+		if (memberc && !devino_cmp(&memberv[memberc-1].filev[0], &filev[i])) {
+			memberv[memberc-1].filec++;
+			continue;
+		}
+
+		cmp_member* m = &memberv[memberc++];
+		m->filev = &filev[i];
+		m->filec = 1;
+		m->fd = -1;
+	}
+
+	if (memberc <= COMPARE_MAX_FILES) {
+		for (i = 0; i < memberc; ++i)
+			orderv[i] = &memberv[i];
+
+		compare_batch(orderv, memberc, blk, emit_files, &e);
+
+	} else {
+		/* too many to be read in lockstep: split by digest first, one
+		 * file at a time, so only likely duplicates are compared */
+		for (i = 0; i < memberc; ++i)
+			if (!member_digest(&memberv[i], compare_buf(0, blk), blk))
+				orderv[orderc++] = &memberv[i];
+
+		qsort(orderv, orderc, sizeof(orderv[0]), digest_cmp);
+
+		size_t start, end;
+
+		for (start = 0; start < orderc; start = end) {
+			for (end = start + 1; end < orderc; ++end)
+				if (orderv[end]->digest != orderv[start]->digest)
+					break;
+
+			compare_leader(orderv + start, end - start, blk, emit_files, &e);
+		}
+	}
+
+	for (i = 0; i < memberc; ++i)
+		free(memberv[i].path);
+
+	free(orderv);
+	free(memberv);
+	free(filev);
+
+} // }}}
@@ -0,0 +1,45 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_COMPARE_H
+#define __FILEDEDUP_COMPARE_H
+
+#include "state.h"
+
+/*****************************************************
+ *
+ * Byte by byte comparison (--eval=compare)
+ *
+ * All the inodes of a cluster are read in lockstep, one block at a
+ * time; whenever the blocks differ, the cluster is split, and files
+ * left alone in their group are no longer read.  Hardlinks are read
+ * once.  Clusters of more than COMPARE_MAX_FILES inodes are split by
+ * an xxh3 digest first, and then compared against a leader in batches
+ * of COMPARE_MAX_FILES, so open files and blocks stay bounded.
+ *
+ * compare_group_fn is called once per group of identical files (a
+ * single inode, possibly with several paths, is a group too).
+ *
+ */
+
+typedef void (*compare_group_fn)(file_t** filev, size_t filec, void* cbdata);
+
+void compare_cluster(cluster_t* cluster, compare_group_fn fn, void* cbdata);
+
+#endif
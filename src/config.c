@@ -42,8 +42,22 @@ struct config_t* config_init(struct config_t* cfg) { // {{{
 	cfg->verbose = 0;
 	cfg->nice = 0;
 	cfg->ionice = 0;
+	cfg->jobs = 1;
+	cfg->walkers = 1;
+	cfg->io_depth_rot = IO_DEPTH_ROTATIONAL;
+	cfg->io_depth_ssd = IO_DEPTH_SOLID;
+	cfg->order = 'n';
+	cfg->prefetch = 0;
 	cfg->read_policy = 'm';
 	cfg->bufsize = 4096*4096;
+	cfg->uring_depth = 32;
+	cfg->mmap_advice = 0;
+	cfg->catalog = NULL;
+	cfg->prescan = 0;
+	cfg->group = 'h';
+	cfg->stream = 0;
+	cfg->spill_dir = NULL;
+	cfg->max_memory = 0;
 	cfg->minage = 0;
 	cfg->cgroups = NULL;
 	cfg->cgroupc = 0;
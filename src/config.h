@@ -26,6 +26,17 @@
 #endif
 
 #define CONFIG_DRYRUN     0x01
+#define CONFIG_STAT_DONT_SYNC 0x20 /* statx(2) AT_STATX_DONT_SYNC */
+#define CONFIG_READ_DONTNEED 0x40 /* --read=read,size,dontneed */
+
+#define PRESCAN_DEFAULT_SIZE (16*1024*1024) /* --prescan without size */
+#define STREAM_DEFAULT_BATCH 4096 /* --stream without a size, in files */
+#define PIPELINE_QUEUE_SIZE 4096 /* items waiting between two pipeline stages */
+#define IO_DEPTH_ROTATIONAL 1 /* readers at once on a rotational disk */
+#define IO_DEPTH_SOLID 16 /* readers at once on any other device */
+#define MAX_PREFETCH 1024 /* --prefetch */
+#define DIRECT_ALIGN 4096 /* --read=direct offsets, lengths and buffers */
+#define SPILL_DEFAULT_MEMORY (256*1024*1024) /* --spill-dir without --max-memory */
 
 /*****************************************************
  *
@@ -59,17 +70,39 @@ int path_source_set(int *cfg_flag, int value);
 int link_type_aton(const char* s);
 char* link_type_ntoa(int m);
 
+/*****************************************************
+ *
+ * Optional madvise(2) calls of --read=mmap
+ *
+ */
+#define MMAP_ADVICE_HUGEPAGE 0x01
+#define MMAP_ADVICE_POPULATE 0x02
+
 #include "discriminant.h"
 
 struct config_t {
 
-	int flags; /* CONFIG_DRYRUN | PATHSOURCE_* | LINK_TYPE_* */
+	int flags; /* CONFIG_* | PATHSOURCE_* | LINK_TYPE_* */
 	int verbose;
 
 	int nice;
 	int ionice;
-	char read_policy; /* 'r': read, 'm': mmap */
+	int jobs; /* hashing threads, 1..MAX_JOBS */
+	int walkers; /* directory walking threads, 1..MAX_JOBS */
+	unsigned io_depth_rot; /* readers at once per rotational device */
+	unsigned io_depth_ssd; /* readers at once per other device */
+	char order; /* 'n': as found, 'i': inode, 'f': first extent (FIEMAP) */
+	unsigned prefetch; /* --prefetch: files read ahead per device, 0: none */
+	char read_policy; /* 'r': read, 'm': mmap, 'u': io_uring, 'd': O_DIRECT */
 	unsigned bufsize;
+	unsigned uring_depth; /* files in flight with --read=uring */
+	int mmap_advice; /* MMAP_ADVICE_*, extra madvise(2) with --read=mmap */
+	char* catalog; /* --catalog file, NULL if none */
+	size_t prescan; /* --prescan size filter bytes, 0: single pass */
+	char group; /* 'h': hash tables, 'r': radix sorted records */
+	size_t stream; /* --stream batch in files, 0: one step at a time */
+	char* spill_dir; /* --spill-dir, NULL: classify in memory */
+	size_t max_memory; /* --max-memory, records sorted in memory at once */
 	unsigned long minage;
 	char** cgroups;
 	int cgroupc;
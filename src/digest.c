@@ -18,22 +18,29 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include "digest.h"
 #include "discriminant.h"
 #include "state.h"
 #include "config.h"
 #include "error.h"
+#include "uring.h"
+#include "catalog.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 typedef struct digest_mds {
-	int digest_mask;
+	int digest_mask;   /** algorithms whose digest this step needs */
+	int carry_mask;    /** algorithms carried on to the next step  */
 	const EVP_MD *md5;
 	const EVP_MD *sha1;
 	const EVP_MD *sha224;
@@ -41,87 +48,128 @@ typedef struct digest_mds {
 	const EVP_MD *sha384;
 	const EVP_MD *sha512;
 	const EVP_MD *ripemd160;
+	const EVP_MD *blake2b512;
 } digest_mds;
 
 digest_mds _mds;
 
-void digest_setup(int disc_mask) { // {{{
+/* Where each algorithm lives in digest_mds, digest_state_t and digest_t */
+typedef struct digest_algo {
+	int method;
+	const EVP_MD* (*evp)(void);   /** NULL for the in-tree xxh3 */
+	size_t md_off;
+	size_t ctx_off;
+	size_t out_off;
+	unsigned out_len;
+} digest_algo;
+
+#define DIGEST_ALGO(method, name) {                                        \
+	method, EVP_##name,                                                \
+	offsetof(digest_mds, name), offsetof(digest_state_t, name),        \
+	offsetof(digest_t, name), sizeof(((digest_t*)0)->name) }
+
+#define DIGEST_NATIVE(method, name) {                                      \
+	method, NULL, 0, offsetof(digest_state_t, name),                   \
+	offsetof(digest_t, name), sizeof(((digest_t*)0)->name) }
+
+static const digest_algo algov[] = {
+	DIGEST_ALGO(DISC_MD5, md5),
+	DIGEST_ALGO(DISC_SHA1, sha1),
+	DIGEST_ALGO(DISC_SHA224, sha224),
+	DIGEST_ALGO(DISC_SHA256, sha256),
+	DIGEST_ALGO(DISC_SHA384, sha384),
+	DIGEST_ALGO(DISC_SHA512, sha512),
+	DIGEST_ALGO(DISC_RIPEMD160, ripemd160),
+	DIGEST_ALGO(DISC_BLAKE2B, blake2b512),
+	DIGEST_NATIVE(DISC_XXH3, xxh3),
+};
+
+#define ALGOC (sizeof(algov)/sizeof(algov[0]))
+
+#define algo_md(a)       (*(const EVP_MD**)((char*)&_mds + (a)->md_off))
+#define algo_ctx(s, a)   (*(void**)((char*)(s) + (a)->ctx_off))
+#define algo_out(t, a)   ((unsigned char*)(t) + (a)->out_off)
+
+static void* algo_new(const digest_algo* a) { // {{{
+
+	if (!a->evp) {
+		xxh3_state_t* x = (xxh3_state_t*)malloc(sizeof(*x));
+		xxh3_init(x);
+		return x;
+	}
 
-	OpenSSL_add_all_digests();
+	EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+	EVP_DigestInit_ex(ctx, algo_md(a), NULL);
+	return ctx;
+} // }}}
 
-	memset(&_mds, 0, sizeof(_mds));
+static void algo_update(const digest_algo* a, void* ctx, const void* b, size_t len) { // {{{
+	if (a->evp)
+		EVP_DigestUpdate((EVP_MD_CTX*)ctx, b, len);
+	else
+		xxh3_update((xxh3_state_t*)ctx, b, len);
+} // }}}
+
+/* keep: ctx goes on being updated afterwards */
+static void algo_final(const digest_algo* a, void* ctx, unsigned char* out, int keep) { // {{{
 
-	_mds.digest_mask = disc_mask & DISC_CONTENT_MASK;
+	unsigned int len = a->out_len;
 
-	if (_mds.digest_mask & DISC_MD5)
-		_mds.md5 = EVP_md5();
+	if (!a->evp) {
+		xxh3_final((xxh3_state_t*)ctx, out);
 
-	if (_mds.digest_mask & DISC_SHA1)
-		_mds.sha1 = EVP_sha1();
+	} else if (keep) {
+		EVP_MD_CTX* tmp = EVP_MD_CTX_create();
+		EVP_MD_CTX_copy_ex(tmp, (EVP_MD_CTX*)ctx);
+		EVP_DigestFinal_ex(tmp, out, &len);
+		EVP_MD_CTX_destroy(tmp);
 
-	if (_mds.digest_mask & DISC_SHA224)
-		_mds.sha224 = EVP_sha224();
+	} else {
+		EVP_DigestFinal_ex((EVP_MD_CTX*)ctx, out, &len);
+	}
+
+} // }}}
 
-	if (_mds.digest_mask & DISC_SHA256)
-		_mds.sha256 = EVP_sha256();
+static void algo_delete(const digest_algo* a, void* ctx) { // {{{
+	if (a->evp)
+		EVP_MD_CTX_destroy((EVP_MD_CTX*)ctx);
+	else
+		free(ctx);
+} // }}}
 
-	if (_mds.digest_mask & DISC_SHA384)
-		_mds.sha384 = EVP_sha384();
+void digest_setup(struct discriminant_t* disc) { // {{{
 
-	if (_mds.digest_mask & DISC_SHA512)
-		_mds.sha512 = EVP_sha512();
+	OpenSSL_add_all_digests();
+
+	memset(&_mds, 0, sizeof(_mds));
 
-	if (_mds.digest_mask & DISC_RIPEMD160)
-		_mds.ripemd160 = EVP_ripemd160();
+	_mds.digest_mask = disc->methods & DISC_DIGEST_MASK;
+	_mds.carry_mask = disc->carry & DISC_DIGEST_MASK;
+
+	int i = 0;
+	for (; i < ALGOC; ++i)
+		if (((_mds.digest_mask | _mds.carry_mask) & algov[i].method) && algov[i].evp)
+			algo_md(&algov[i]) = algov[i].evp();
 
 } // }}}
 
 int digest_init(digest_state_t* s) { // {{{
 
 	int digestc = 0;
+	int i = 0;
 
 	memset(s, 0, sizeof(*s));
 
-	if (_mds.digest_mask & DISC_MD5) {
-		s->md5 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->md5, _mds.md5, NULL);
-		++digestc;
-	}
+	for (; i < ALGOC; ++i) {
+		const digest_algo* a = &algov[i];
 
-	if (_mds.digest_mask & DISC_SHA1) {
-		s->sha1 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->sha1, _mds.sha1, NULL);
-		++digestc;
-	}
+		if (!((_mds.digest_mask | _mds.carry_mask) & a->method))
+			continue;
 
-	if (_mds.digest_mask & DISC_SHA224) {
-		s->sha224 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->sha224, _mds.sha224, NULL);
-		++digestc;
-	}
+		algo_ctx(s, a) = algo_new(a);
 
-	if (_mds.digest_mask & DISC_SHA256) {
-		s->sha256 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->sha256, _mds.sha256, NULL);
-		++digestc;
-	}
-
-	if (_mds.digest_mask & DISC_SHA384) {
-		s->sha384 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->sha384, _mds.sha384, NULL);
-		++digestc;
-	}
-
-	if (_mds.digest_mask & DISC_SHA512) {
-		s->sha512 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->sha512, _mds.sha512, NULL);
-		++digestc;
-	}
-
-	if (_mds.digest_mask & DISC_RIPEMD160) {
-		s->ripemd160 = EVP_MD_CTX_create();
-		EVP_DigestInit_ex(s->ripemd160, _mds.ripemd160, NULL);
-		++digestc;
+		if (_mds.digest_mask & a->method)
+			++digestc;
 	}
 
 	return digestc;
@@ -133,146 +181,677 @@ void digest_clean() {
 
 void digest_update(digest_state_t* s, const void* b, size_t len) { // {{{
 
-	if (s->md5)
-		EVP_DigestUpdate(s->md5, b, len);
+	int i = 0;
 
-	if (s->sha1)
-		EVP_DigestUpdate(s->sha1, b, len);
+	for (; i < ALGOC; ++i)
+		if (algo_ctx(s, &algov[i]))
+			algo_update(&algov[i], algo_ctx(s, &algov[i]), b, len);
 
-	if (s->sha224)
-		EVP_DigestUpdate(s->sha224, b, len);
-
-	if (s->sha256)
-		EVP_DigestUpdate(s->sha256, b, len);
+} // }}}
 
-	if (s->sha384)
-		EVP_DigestUpdate(s->sha384, b, len);
+void digest_destroy(digest_state_t* s) { // {{{
 
-	if (s->sha512)
-		EVP_DigestUpdate(s->sha512, b, len);
+	int i = 0;
 
-	if (s->ripemd160)
-		EVP_DigestUpdate(s->ripemd160, b, len);
+	for (; i < ALGOC; ++i) {
+		if (algo_ctx(s, &algov[i]))
+			algo_delete(&algov[i], algo_ctx(s, &algov[i]));
+		algo_ctx(s, &algov[i]) = NULL;
+	}
 
 } // }}}
 
-void digest_final(digest_state_t* s, digest_t* t) { // {{{
+digest_resume_t* digest_final(digest_state_t* s, digest_t* t, off_t offset) { // {{{
 
-	unsigned int len;
-       
-	if (s->md5) {
-		len = sizeof(t->md5);
-		EVP_DigestFinal_ex(s->md5, t->md5, &len);
+	digest_resume_t* carry = NULL;
+	int i = 0;
+
+	if (_mds.carry_mask) {
+		carry = (digest_resume_t*)calloc(1, sizeof(*carry));
+		carry->offset = offset;
 	}
 
-	if (s->sha1) {
-		len = sizeof(t->sha1);
-		EVP_DigestFinal_ex(s->sha1, t->sha1, &len);
+	for (; i < ALGOC; ++i) {
+		const digest_algo* a = &algov[i];
+		void* ctx = algo_ctx(s, a);
+
+		if (!ctx)
+			continue;
+
+		if (carry && (_mds.carry_mask & a->method)) {
+
+			/* the context goes on in the next step */
+			if (_mds.digest_mask & a->method)
+				algo_final(a, ctx, algo_out(t, a), 1);
+
+			algo_ctx(&carry->state, a) = ctx;
+			algo_ctx(s, a) = NULL;
+			continue;
+		}
+
+		if (_mds.digest_mask & a->method)
+			algo_final(a, ctx, algo_out(t, a), 0);
+
+		algo_delete(a, ctx);
+		algo_ctx(s, a) = NULL;
 	}
 
-	if (s->sha224) {
-		len = sizeof(t->sha224);
-		EVP_DigestFinal_ex(s->sha224, t->sha224, &len);
+	return carry;
+} // }}}
+
+size_t digest_pack(int methods, const digest_t* t, unsigned char* out) { // {{{
+
+	size_t len = 0;
+	int i = 0;
+
+	for (; i < ALGOC; ++i) {
+		if (!(methods & algov[i].method))
+			continue;
+		if (out)
+			memcpy(out + len, algo_out(t, &algov[i]), algov[i].out_len);
+		len += algov[i].out_len;
 	}
 
-	if (s->sha256) {
-		len = sizeof(t->sha256);
-		EVP_DigestFinal_ex(s->sha256, t->sha256, &len);
+	return len;
+} // }}}
+
+void digest_unpack(int methods, const unsigned char* in, digest_t* t) { // {{{
+
+	int i = 0;
+
+	for (; i < ALGOC; ++i) {
+		if (!(methods & algov[i].method))
+			continue;
+		memcpy(algo_out(t, &algov[i]), in, algov[i].out_len);
+		in += algov[i].out_len;
 	}
 
-	if (s->sha384) {
-		len = sizeof(t->sha384);
-		EVP_DigestFinal_ex(s->sha384, t->sha384, &len);
+} // }}}
+
+int digest_resume(digest_state_t* s, digest_resume_t** resume, off_t* offset) { // {{{
+
+	digest_resume_t* r = *resume;
+	int usable = r != NULL;
+	int i = 0;
+
+	*resume = NULL;
+	*offset = 0;
+
+	/* every context this step needs must have been carried */
+	for (; usable && (i < ALGOC); ++i)
+		if (((_mds.digest_mask | _mds.carry_mask) & algov[i].method) &&
+		    !algo_ctx(&r->state, &algov[i]))
+			usable = 0;
+
+	if (!usable) {
+		digest_resume_delete(r);
+		return digest_init(s);
 	}
 
-	if (s->sha512) {
-		len = sizeof(t->sha512);
-		EVP_DigestFinal_ex(s->sha512, t->sha512, &len);
+	memset(s, 0, sizeof(*s));
+
+	int digestc = 0;
+
+	for (i = 0; i < ALGOC; ++i) {
+		const digest_algo* a = &algov[i];
+
+		if ((_mds.digest_mask | _mds.carry_mask) & a->method) {
+			algo_ctx(s, a) = algo_ctx(&r->state, a);
+			algo_ctx(&r->state, a) = NULL;
+		}
+
+		if (_mds.digest_mask & a->method)
+			++digestc;
 	}
 
-	if (s->ripemd160) {
-		len = sizeof(t->ripemd160);
-		EVP_DigestFinal_ex(s->ripemd160, t->ripemd160, &len);
+	*offset = r->offset;
+	digest_resume_delete(r);
+
+	return digestc;
+} // }}}
+
+void digest_resume_delete(digest_resume_t* r) { // {{{
+
+	if (!r)
+		return;
+
+	digest_destroy(&r->state);
+	free(r);
+
+} // }}}
+
+static pthread_key_t _buf_key;
+static pthread_once_t _buf_once = PTHREAD_ONCE_INIT;
+
+static void digest_buf_key_init() { // {{{
+	pthread_key_create(&_buf_key, free);
+} // }}}
+
+/* One read(2) buffer per hashing thread, freed when the thread exits.
+ * It is aligned for O_DIRECT. */
+static char* digest_buf() { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	pthread_once(&_buf_once, digest_buf_key_init);
+
+	char* buf = (char*)pthread_getspecific(_buf_key);
+	if (!buf) {
+		if (posix_memalign((void**)&buf, DIRECT_ALIGN, cfg->bufsize))
+			fatal("Could not allocate a read buffer of %u bytes.\n", cfg->bufsize);
+		pthread_setspecific(_buf_key, buf);
 	}
 
+	return buf;
 } // }}}
 
-int digest_file(const char* filename, struct stat* _st, struct digest_t* digest) { // {{{
+/* --read=direct: reads bypass the page cache, so they must start at a
+ * DIRECT_ALIGN boundary and be a multiple of it long.  The bytes before
+ * *offset (hashed in an earlier step) and from end on are not hashed. */
+static int read_direct(int fd, const char* filename, off_t* offset, off_t end, digest_state_t* state) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	char* buf = digest_buf();
+	off_t pos = *offset & ~(off_t)(DIRECT_ALIGN - 1);
+
+	while (*offset < end) {
+		size_t nbytes = cfg->bufsize;
+		if (pos + (off_t)nbytes > end)
+			nbytes = (end - pos + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+
+		ssize_t nread = pread(fd, buf, nbytes, pos);
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* O_DIRECT accepted by open(2), but not on read(2) */
+			if ((errno == EINVAL) && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+				continue;
+			}
+
+			error("Error on read from %s: %s\n.", filename, strerror(errno));
+			return -1;
+		}
+
+		if (nread == 0)
+			break;
+
+		off_t skip = *offset - pos;
+		off_t len = nread - skip;
+		if (pos + nread > end)
+			len = end - *offset;
+
+		if (len > 0) {
+			digest_update(state, buf + skip, len);
+			*offset += len;
+		}
+
+		pos += nread;
+
+		/* the (unaligned) end of the file */
+		if ((size_t)nread < nbytes)
+			break;
+	}
+
+	return 0;
+} // }}}
+
+void digest_prefetch(const char* filename, const finfo_t* fi, off_t offset) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	/* --read=direct doesn't go through the page cache */
+	if ((!_mds.digest_mask && !_mds.carry_mask) || (cfg->read_policy == 'u') || (cfg->read_policy == 'd'))
+		return;
+
+	struct discriminant_t* disc = current_discriminant();
+	off_t length = fi->size;
+
+	if (disc->end && (disc->end < length))
+		length = disc->end;
+
+	/* the first chunk; digest_file() asks for the next ones */
+	if (length - offset > cfg->bufsize)
+		length = offset + cfg->bufsize;
+
+	if (offset >= length)
+		return;
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, offset, length - offset, POSIX_FADV_WILLNEED);
+	close(fd);
+} // }}}
+
+int digest_file(const char* filename, finfo_t* fi, digest_resume_t** resume, struct digest_t* digest) { // {{{
 
 	digest_state_t state;
-	int digestc = digest_init(&state);
+	off_t offset = 0;
+	int digestc = 0;
+
+	/* a step without content discriminants hands the carried state on */
+	if (!_mds.digest_mask && !_mds.carry_mask)
+		return 0;
+
+	struct discriminant_t* disc = current_discriminant();
+
+	/* unchanged since an earlier run: nothing to read, nor to carry */
+	if (catalog_lookup(fi, disc, digest)) {
+		digest_resume_delete(*resume);
+		*resume = NULL;
+		return 1;
+	}
+
+	digestc = digest_resume(&state, resume, &offset);
 
 	CACHED_CONFIG(cfg);
 
 	if (digestc) {
 
-		int fd = open(filename, O_RDONLY);
+		int direct = cfg->read_policy == 'd';
+		int fd = open(filename, O_RDONLY | (direct ? O_DIRECT : 0));
+
+		/* filesystems without O_DIRECT: read(2), dropping the pages */
+		if ((fd < 0) && direct && (errno == EINVAL)) {
+			direct = 0;
+			fd = open(filename, O_RDONLY);
+		}
+
 		if (fd < 0) {
 			error("Could not open \"%s\": %s.\n", filename, strerror(errno));
+			digest_destroy(&state);
 			return -1;
 		}
 
-		struct discriminant_t* disc = current_discriminant();
+		if (direct) {
+			if (read_direct(fd, filename, &offset, disc->end ? disc->end : INT64_MAX, &state) < 0) {
+				close(fd);
+				digest_destroy(&state);
+				return -1;
+			}
+
+		/* 'u' reads one file at a time here; batches go through
+		 * digest_files_uring() */
+		} else if ((cfg->read_policy == 'r') || (cfg->read_policy == 'u') || (cfg->read_policy == 'd')) {
 
-		if (cfg->read_policy == 'r') {
+			char* buf = digest_buf();
+			int dontneed = (cfg->flags & CONFIG_READ_DONTNEED) || (cfg->read_policy == 'd');
 
-			static char* buf = NULL;
-			if (!buf)
-				buf = (char*)malloc(cfg->bufsize);
+			/* Pages are dropped once hashed, and only whole ones
+			 * are: a page shared with the next chunk waits for it.
+			 * No kernel readahead either, past the chunks hashed,
+			 * which would be left cached. */
+			off_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+			off_t dropped = offset & ~pagemask;
 
-			off_t offset = 0;
+			if (dontneed)
+				posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
 
 			while (1) {
 				size_t nbytes = cfg->bufsize;
 				if (disc->end && ((offset + nbytes) > disc->end))
 					nbytes = disc->end - offset;
 
-				ssize_t nread = read(fd, buf, nbytes);
+				ssize_t nread = pread(fd, buf, nbytes, offset);
 
 				if (nread < 0) {
 					if (errno == EINTR)
 						continue;
 					error("Error on read from %s: %s\n.", filename, strerror(errno));
+					close(fd);
+					digest_destroy(&state);
 					return -1;
 				}
 
-				if (nread == 0)
+				if (nread == 0) {
+					/* the page holding the last byte */
+					off_t upto = (offset + pagemask) & ~pagemask;
+					if (dontneed && (upto > dropped))
+						posix_fadvise(fd, dropped, upto - dropped, POSIX_FADV_DONTNEED);
 					break;
+				}
+
+				/* with --prefetch, the next chunk is read by the
+				 * kernel while this one is hashed; not with dontneed,
+				 * whose point is to keep pages out of the cache */
+				off_t next = offset + nread;
+				off_t ahead = cfg->bufsize;
+				if (disc->end && (next + ahead > disc->end))
+					ahead = disc->end - next;
+				if (cfg->prefetch && !dontneed && (next < fi->size) && (ahead > 0))
+					posix_fadvise(fd, next, ahead, POSIX_FADV_WILLNEED);
 
 				digest_update(&state, buf, nread);
 
 				offset += nread;
+
+				/* keeps the page cache of whatever else runs on the host */
+				off_t upto = offset & ~pagemask;
+				if (dontneed && (upto > dropped)) {
+					posix_fadvise(fd, dropped, upto - dropped, POSIX_FADV_DONTNEED);
+					dropped = upto;
+				}
 			}
-				
+
 		} else if (cfg->read_policy == 'm') {
 
-			off_t length = _st->st_size;
-			off_t offset = 0;
+			off_t length = fi->size;
 
-			if (disc->end)
+			if (disc->end && (disc->end < length))
 				length = disc->end;
 
+			/* A resumed digest starts past the bytes hashed in an
+			 * earlier step; the mapping must start at a page boundary. */
+			off_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+			off_t start = offset & ~pagemask;
+			char* b = NULL;  /* b[0] is the byte at start */
+
+			if (offset < length) {
+
+				/* The whole range is mapped once; it is hashed (and
+				 * its pages dropped) bufsize bytes at a time. */
+				b = (char*)mmap(NULL, length - start, PROT_READ, MAP_SHARED, fd, start);
+
+				if (b == MAP_FAILED) {
+					error("Could not mmap \"%s\": %s.\n", filename, strerror(errno));
+					close(fd);
+					digest_destroy(&state);
+					return -1;
+				}
+
+				madvise(b, length - start, MADV_SEQUENTIAL);
+				madvise(b, length - start, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+				if (cfg->mmap_advice & MMAP_ADVICE_HUGEPAGE)
+					madvise(b, length - start, MADV_HUGEPAGE);
+#endif
+			}
+
 			while (offset < length) {
 
 				off_t ilen = cfg->bufsize;
 				if (offset + ilen > length)
 					ilen = length - offset;
 
-				void* b = mmap(NULL, ilen, PROT_READ, MAP_SHARED /* ? */, fd, offset);
+				/* madvise(2) wants page aligned addresses */
+				char* page = b + ((offset & ~pagemask) - start);
+				size_t plen = offset + ilen - (offset & ~pagemask);
+
+#ifdef MADV_POPULATE_READ
+				/* one syscall instead of a page fault per page */
+				if (cfg->mmap_advice & MMAP_ADVICE_POPULATE)
+					madvise(page, plen, MADV_POPULATE_READ);
+#endif
 
-				digest_update(&state, b, ilen);
+				digest_update(&state, b + (offset - start), ilen);
 
-				munmap(b, ilen);
+				/* keeps RSS bounded; the page cache is left alone */
+				madvise(page, plen, MADV_DONTNEED);
 				offset += ilen;
 			}
 
+			if (b)
+				munmap(b, length - start);
+
 		}
 
 		close(fd);
 
-		digest_final(&state, digest);
 	}
 
+	*resume = digest_final(&state, digest, offset);
+
+	if (digestc)
+		catalog_store(fi, disc, digest);
+
 	return digestc;
 } // }}}
 
+
+/*****************************************************
+ *
+ * io_uring engine: up to uring_depth files of a step are open at once,
+ * each with one read in flight.  Completed buffers are hashed as they
+ * arrive, while the reads of the other files proceed.
+ *
+ */
+
+#define URING_MAX_CHUNK (1024*1024)
+#define URING_IGNORE    (~0ULL)  /** user_data of the close requests */
+
+enum { SLOT_FREE, SLOT_OPEN, SLOT_READ };
+
+typedef struct uring_slot {
+	int stage;
+	struct file_t* file;
+	char* path;         /** of file, while it is being opened and read */
+	int fd;
+	off_t offset;
+	char* buf;
+	digest_state_t state;
+} uring_slot;
+
+int digest_uring_available() { // {{{
+
+	static int _available = -1;
+
+	if (_available < 0) {
+		uring r;
+		int err = uring_init(&r, 2);
+
+		if (err) {
+			warning("io_uring not available (%s), using read(2).\n", strerror(-err));
+			_available = 0;
+
+		} else {
+			_available = uring_supports(&r, IORING_OP_OPENAT) &&
+				uring_supports(&r, IORING_OP_READ) &&
+				uring_supports(&r, IORING_OP_CLOSE);
+
+			if (!_available)
+				warning("io_uring lacks openat/read/close support, using read(2).\n");
+
+			uring_destroy(&r);
+		}
+	}
+
+	return _available;
+} // }}}
+
+static size_t uring_chunk() { // {{{
+	CACHED_CONFIG(cfg);
+	return cfg->bufsize < URING_MAX_CHUNK ? cfg->bufsize : URING_MAX_CHUNK;
+} // }}}
+
+static void uring_queue_read(uring* r, uring_slot* slot, unsigned islot) { // {{{
+
+	struct discriminant_t* disc = current_discriminant();
+	size_t nbytes = uring_chunk();
+
+	if (disc->end && ((slot->offset + nbytes) > disc->end))
+		nbytes = disc->end - slot->offset;
+
+	struct io_uring_sqe* sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long)slot->buf;
+	sqe->len = nbytes;
+	sqe->off = slot->offset;
+	sqe->user_data = islot;
+
+	slot->stage = SLOT_READ;
+} // }}}
+
+static unsigned uring_closing = 0;  /** close requests in flight */
+
+static void uring_queue_close(uring* r, uring_slot* slot) { // {{{
+
+	struct io_uring_sqe* sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = slot->fd;
+	sqe->user_data = URING_IGNORE;
+
+	slot->fd = -1;
+	++uring_closing;
+} // }}}
+
+static void uring_slot_end(uring_slot* slot) { // {{{
+	digest_destroy(&slot->state);
+	free(slot->path);
+	slot->path = NULL;
+	slot->stage = SLOT_FREE;
+} // }}}
+
+void digest_files_uring(struct file_t** filev, size_t filec, digest_begin_fn begin, digest_done_fn done) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	unsigned depth = cfg->uring_depth;
+	uring r;
+	size_t ifile = 0;
+	unsigned busy = 0;
+	unsigned i;
+
+	/* every slot may have a read (or open) and a close in flight */
+	int err = uring_init(&r, 2 * depth);
+	if (err)
+		fatal("Could not set up io_uring: %s.\n", strerror(-err));
+
+	/* nothing to read in this step */
+	if (!_mds.digest_mask && !_mds.carry_mask) {
+		digest_t digest;
+		for (; ifile < filec; ++ifile)
+			if (begin(filev[ifile]))
+				done(filev[ifile], &digest, NULL);
+		uring_destroy(&r);
+		return;
+	}
+
+	uring_slot* slotv = (uring_slot*)calloc(depth, sizeof(uring_slot));
+	for (i = 0; i < depth; ++i)
+		slotv[i].buf = (char*)malloc(uring_chunk());
+
+	while ((ifile < filec) || busy || uring_closing) {
+
+		for (i = 0; (i < depth) && (ifile < filec); ++i) {
+
+			uring_slot* slot = &slotv[i];
+
+			if (slot->stage != SLOT_FREE)
+				continue;
+
+			struct file_t* file = filev[ifile++];
+
+			if (!begin(file))
+				continue;
+
+			digest_t digest;
+			if (catalog_lookup(&file->fi, current_discriminant(), &digest)) {
+				digest_resume_delete(file->resume);
+				file->resume = NULL;
+				done(file, &digest, NULL);
+				continue;
+			}
+
+			digest_resume(&slot->state, &file->resume, &slot->offset);
+			slot->file = file;
+			slot->path = path_dup(file->path);
+			slot->fd = -1;
+			slot->stage = SLOT_OPEN;
+
+			struct io_uring_sqe* sqe = uring_sqe(&r);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)slot->path;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			sqe->user_data = i;
+
+			++busy;
+		}
+
+		if (!busy && !uring_closing)
+			break;
+
+		err = uring_submit(&r, 1);
+		if (err < 0)
+			fatal("io_uring_enter failed: %s.\n", strerror(-err));
+
+		struct io_uring_cqe cqe;
+
+		while (uring_cqe(&r, &cqe)) {
+
+			if (cqe.user_data == URING_IGNORE) {
+				--uring_closing;
+				continue;
+			}
+
+			uring_slot* slot = &slotv[cqe.user_data];
+			const char* filename = slot->path;
+
+			if (slot->stage == SLOT_OPEN) {
+
+				if (cqe.res < 0) {
+					error("Could not open \"%s\": %s.\n", filename, strerror(-cqe.res));
+					uring_slot_end(slot);
+					--busy;
+					continue;
+				}
+
+				slot->fd = cqe.res;
+				uring_queue_read(&r, slot, cqe.user_data);
+				continue;
+			}
+
+			if ((cqe.res == -EINTR) || (cqe.res == -EAGAIN)) {
+				uring_queue_read(&r, slot, cqe.user_data);
+				continue;
+			}
+
+			if (cqe.res < 0) {
+				error("Error on read from %s: %s\n.", filename, strerror(-cqe.res));
+				uring_queue_close(&r, slot);
+				uring_slot_end(slot);
+				--busy;
+				continue;
+			}
+
+			struct discriminant_t* disc = current_discriminant();
+
+			if (cqe.res > 0) {
+				digest_update(&slot->state, slot->buf, cqe.res);
+				slot->offset += cqe.res;
+
+				if (!disc->end || (slot->offset < disc->end)) {
+					uring_queue_read(&r, slot, cqe.user_data);
+					continue;
+				}
+			}
+
+			/* EOF, or the end of the range to hash */
+			digest_t digest;
+			uring_queue_close(&r, slot);
+			digest_resume_t* carry = digest_final(&slot->state, &digest, slot->offset);
+			free(slot->path);
+			slot->path = NULL;
+			slot->stage = SLOT_FREE;
+			--busy;
+
+			if (_mds.digest_mask)
+				catalog_store(&slot->file->fi, disc, &digest);
+
+			done(slot->file, &digest, carry);
+		}
+	}
+
+	for (i = 0; i < depth; ++i)
+		free(slotv[i].buf);
+	free(slotv);
+
+	uring_destroy(&r);
+
+} // }}}
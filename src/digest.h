@@ -26,10 +26,15 @@
 #include <openssl/ripemd.h>
 #include <openssl/evp.h>
 
+#include "xxh3.h"
+#include "finfo.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#define BLAKE2B_DIGEST_LENGTH 64
+
 typedef struct digest_t {
 	unsigned char md5[MD5_DIGEST_LENGTH];
 	unsigned char sha1[SHA_DIGEST_LENGTH];
@@ -38,6 +43,8 @@ typedef struct digest_t {
 	unsigned char sha384[SHA384_DIGEST_LENGTH];
 	unsigned char sha512[SHA512_DIGEST_LENGTH];
 	unsigned char ripemd160[RIPEMD160_DIGEST_LENGTH];
+	unsigned char blake2b512[BLAKE2B_DIGEST_LENGTH];
+	unsigned char xxh3[XXH3_DIGEST_LENGTH];
 } digest_t;
 
 typedef struct digest_state_t {
@@ -48,15 +55,51 @@ typedef struct digest_state_t {
 	EVP_MD_CTX* sha384;
 	EVP_MD_CTX* sha512;
 	EVP_MD_CTX* ripemd160;
+	EVP_MD_CTX* blake2b512;
+	xxh3_state_t* xxh3;
 } digest_state_t;
 
-void digest_setup();
+/* Digest contexts carried from one step to the next, so that a step
+ * extending the range of an earlier one only reads the new bytes. */
+typedef struct digest_resume_t {
+	off_t offset;           /** bytes already hashed */
+	digest_state_t state;
+} digest_resume_t;
+
+struct discriminant_t;
+
+void digest_setup(struct discriminant_t* disc);
 int digest_init(digest_state_t*);
+int digest_resume(digest_state_t*, digest_resume_t** resume, off_t* offset); /** takes *resume, digest_init() if unusable */
 void digest_update(digest_state_t*, const void* b, size_t len);
-void digest_final(digest_state_t*, digest_t*);
+digest_resume_t* digest_final(digest_state_t*, digest_t*, off_t offset);  /** returns the state to carry, if any */
+void digest_destroy(digest_state_t*);
+void digest_resume_delete(digest_resume_t*);
 void digest_clean();
 
-int digest_file(const char* s, struct stat* _st, struct digest_t* digest);
+/* The digests of the given DISC_* methods, back to back; returns their
+ * length.  out may be NULL. */
+size_t digest_pack(int methods, const digest_t* t, unsigned char* out);
+void digest_unpack(int methods, const unsigned char* in, digest_t* t);
+
+/* *resume is the state carried from the previous step (may be NULL); it
+ * is consumed, and replaced by the state to carry to the next one. */
+int digest_file(const char* s, finfo_t* fi, digest_resume_t** resume, struct digest_t* digest);
+
+/* Has the kernel start reading what digest_file() will read first, from
+ * offset (that of the state carried, if any). */
+void digest_prefetch(const char* s, const finfo_t* fi, off_t offset);
+
+/* --read=uring: digests a batch of files, many of them in flight at once.
+ * begin() is called before a file is opened, and may return 0 to skip it;
+ * done() is called with the digest of each file read successfully, and
+ * the state to carry to the next step.  file->resume is consumed. */
+struct file_t;
+typedef int (*digest_begin_fn)(struct file_t* file);
+typedef void (*digest_done_fn)(struct file_t* file, struct digest_t* digest, digest_resume_t* carry);
+
+int digest_uring_available();
+void digest_files_uring(struct file_t** filev, size_t filec, digest_begin_fn begin, digest_done_fn done);
 
 #endif
 
@@ -23,6 +23,7 @@
 #include "config.h"
 #include "string.h"
 #include "error.h"
+#include "htable.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -55,6 +56,9 @@ void discriminant_parse(const char* _disc, struct discriminant_t* disc) { // {{{
 	else if (!strcmp(_disc, "basename"))
 		disc->methods |= DISC_BASENAME;
 
+	else if (!strcmp(_disc, "compare"))
+		disc->methods |= DISC_COMPARE;
+
 	else {
 		char mech[32];
 		unsigned long long end = 0;
@@ -92,6 +96,12 @@ void discriminant_parse(const char* _disc, struct discriminant_t* disc) { // {{{
 		else if (!strcmp(mech, "ripemd160"))
 			idisc = DISC_RIPEMD160;
 
+		else if (!strcmp(mech, "blake2b"))
+			idisc = DISC_BLAKE2B;
+
+		else if (!strcmp(mech, "xxh3"))
+			idisc = DISC_XXH3;
+
 		else
 			fatal("Unknown discriminant method \"%s\"", _disc);
 
@@ -135,11 +145,44 @@ void discriminantv_post_parse(struct discriminant_t* discv, size_t discc) { // {
 		discv[0].methods |= _disc_methods;
 	}
 
+	for (i = 0; i < discc; ++i) {
+		if (!(discv[i].methods & DISC_COMPARE))
+			continue;
+
+		if (!i || (i != discc - 1))
+			fatal("\"compare\" must be the last step, and not the first one.\n");
+
+		if (discv[i].methods & ~DISC_COMPARE)
+			fatal("\"compare\" can't be combined with other methods in the same step.\n");
+	}
+
 	if (link_type_is_hard(config()->flags) && !(discv[0].methods & DISC_DEV)) {
 		warning("Note: forcing \"dev\" in step 0 (will merge with hardlinks).\n");
 		discv[0].methods |= DISC_DEV;
 	}
 
+	/* A prefix step also feeds the contexts of the next content step
+	 * (and transitively, of the ones after it), as long as the ranges
+	 * keep growing. */
+	for (i = discc - 1; i >= 0; --i) {
+		struct discriminant_t* d = &discv[i];
+		struct discriminant_t* next = d + 1;
+
+		d->carry = 0;
+
+		if ((i == discc - 1) || !d->end || !(d->methods & DISC_CONTENT_MASK))
+			continue;
+
+		/* compare reads the files itself, from byte 0 */
+		if (!(next->methods & DISC_DIGEST_MASK))
+			continue;
+
+		if (next->end && (next->end < d->end))
+			continue;
+
+		d->carry = (next->methods | next->carry) & DISC_DIGEST_MASK;
+	}
+
 } // }}}
 
 size_t key_size(struct discriminant_t* d) { // {{{
@@ -166,6 +209,9 @@ size_t key_size(struct discriminant_t* d) { // {{{
 	if (d->methods & DISC_BASENAME)
 		ret += 2 * sizeof(unsigned long);
 
+	if (d->methods & DISC_COMPARE)
+		ret += sizeof(unsigned long);
+
 	if (d->methods & DISC_MD5)
 		ret += MD5_DIGEST_LENGTH;
 
@@ -187,6 +233,12 @@ size_t key_size(struct discriminant_t* d) { // {{{
 	if (d->methods & DISC_RIPEMD160)
 		ret += RIPEMD160_DIGEST_LENGTH;
 
+	if (d->methods & DISC_BLAKE2B)
+		ret += BLAKE2B_DIGEST_LENGTH;
+
+	if (d->methods & DISC_XXH3)
+		ret += XXH3_DIGEST_LENGTH;
+
 	return ret;
 } // }}}
 
@@ -207,13 +259,13 @@ void basename_discriminant(const char* filename, long* h, long* len) { // {{{
 	}
 } // }}}
 
-void* key_alloc(struct discriminant_t* d, size_t* size) { // {{{
-	return calloc(1, *size = key_size(d));
+void* key_alloc(arena* a, struct discriminant_t* d, size_t* size) { // {{{
+	return arena_calloc(a, *size = key_size(d));
 } // }}}
 
-void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, digest_t* digest, size_t* size) { // {{{
+void* key_new(arena* a, struct discriminant_t* d, finfo_t* fi, const char* filename, digest_t* digest, size_t* size) { // {{{
 
-	long* ret = (long*)key_alloc(d, size);
+	long* ret = (long*)key_alloc(a, d, size);
 	long* plong = ret;
 	long _basename_h = 0;
 	long _basename_len = 0;
@@ -221,22 +273,22 @@ void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, d
 	plong++;
 
 	if (d->methods & DISC_DEV)
-		*plong++ = st->st_dev;
+		*plong++ = fi->dev;
 
 	if (d->methods & DISC_SIZE)
-		*plong++ = st->st_size;
+		*plong++ = fi->size;
 
 	if (d->methods & DISC_MTIME)
-		*plong++ = st->st_mtime;
+		*plong++ = fi->mtime;
 
 	if (d->methods & DISC_USER)
-		*plong++ = st->st_uid;
+		*plong++ = fi->uid;
 
 	if (d->methods & DISC_GROUP)
-		*plong++ = st->st_gid;
+		*plong++ = fi->gid;
 
 	if (d->methods & DISC_PERMS)
-		*plong++ = st->st_mode;
+		*plong++ = fi->mode;
 
 	if (d->methods & DISC_BASENAME) {
 		basename_discriminant(filename, &_basename_h, &_basename_len);
@@ -281,6 +333,16 @@ void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, d
 		pchar += sizeof(digest->ripemd160);
 	}
 
+	if (d->methods & DISC_BLAKE2B) {
+		memcpy(pchar, digest->blake2b512, sizeof(digest->blake2b512));
+		pchar += sizeof(digest->blake2b512);
+	}
+
+	if (d->methods & DISC_XXH3) {
+		memcpy(pchar, digest->xxh3, sizeof(digest->xxh3));
+		pchar += sizeof(digest->xxh3);
+	}
+
 	ret[0] = pchar - (char*)ret; // size in bytes
 
 	if (verbose() > 2) {
@@ -290,22 +352,22 @@ void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, d
 			debug("key(%u)=%s", (unsigned)*size, bin2hex(ret, *size));
 
 		if (d->methods & DISC_DEV)
-			debug("dev=%lx\n", (unsigned long)st->st_dev);
+			debug("dev=%lx\n", (unsigned long)fi->dev);
 
 		if (d->methods & DISC_SIZE)
-			debug("size=%lu\n", (unsigned long)st->st_size);
+			debug("size=%lu\n", (unsigned long)fi->size);
 
 		if (d->methods & DISC_MTIME)
-			debug("mtime=%lu\n", (unsigned long)st->st_mtime);
+			debug("mtime=%lu\n", (unsigned long)fi->mtime);
 
 		if (d->methods & DISC_USER)
-			debug("uid=%ld\n", (long)st->st_uid);
+			debug("uid=%ld\n", (long)fi->uid);
 
 		if (d->methods & DISC_GROUP)
-			debug("gid=%ld\n", (long)st->st_gid);
+			debug("gid=%ld\n", (long)fi->gid);
 
 		if (d->methods & DISC_SIZE)
-			debug("perms=%o\n", st->st_mode);
+			debug("perms=%o\n", fi->mode);
 
 		if (d->methods & DISC_BASENAME)
 			debug("basename=%ld,%lx\n", _basename_h, _basename_len);
@@ -335,13 +397,33 @@ void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, d
 		if (d->methods & DISC_RIPEMD160)
 			debug("ripemd160%s=%s", _end, bin2hex(digest->ripemd160, sizeof(digest->ripemd160)));
 
+		if (d->methods & DISC_BLAKE2B)
+			debug("blake2b%s=%s", _end, bin2hex(digest->blake2b512, sizeof(digest->blake2b512)));
+
+		if (d->methods & DISC_XXH3)
+			debug("xxh3%s=%s", _end, bin2hex(digest->xxh3, sizeof(digest->xxh3)));
+
 		free(_end);
 	}
 
 	return ret;
 } // }}}
 
-void key_delete(void* key) { // {{{
-	free(key);
+void key_delete(arena* a, void* key) { // {{{
+	arena_release(a, key);
+} // }}}
+
+uint64_t key_hash(struct discriminant_t* d, long* key, size_t keylen) { // {{{
+
+	/* Nothing but digests after key[0] (stat methods are moved to step
+	 * 0): their last bytes are as good a hash as any.  Not so the serial
+	 * numbers of compare. */
+	if ((d->methods & DISC_DIGEST_MASK) && !(d->methods & ~DISC_DIGEST_MASK)) {
+		uint64_t h;
+		memcpy(&h, (char*)key + keylen - sizeof(h), sizeof(h));
+		return h;
+	}
+
+	return htable_hash(key, keylen);
 } // }}}
 
@@ -26,6 +26,7 @@
 #include <unistd.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 
 /*****************************************************
  *
@@ -44,6 +45,7 @@
 #define DISC_STAT_MASK      0x003f
 #define DISC_BASENAME       0x0040
                             
+#define DISC_XXH3           0x0100  /* fast, not cryptographic */
 #define DISC_MD5            0x0200
 #define DISC_SHA1           0x0400
 #define DISC_SHA224         0x0800
@@ -51,7 +53,10 @@
 #define DISC_SHA384         0x2000
 #define DISC_SHA512         0x4000
 #define DISC_RIPEMD160      0x8000
-#define DISC_CONTENT_MASK   0xff00
+#define DISC_COMPARE       0x10000  /* byte by byte, not a digest */
+#define DISC_BLAKE2B       0x20000
+#define DISC_CONTENT_MASK  0x2ff00
+#define DISC_DIGEST_MASK   0x2ef00  /* content methods but compare */
                               
 #define DISC_METHODC            14
 
@@ -60,6 +65,11 @@ struct discriminant_t {
 
 	/* This is used only when building hashes of parts of the content */
 	unsigned long long end;
+
+	/* Content methods of later steps that are also fed the first end
+	 * bytes in this step, so those steps resume instead of re-reading.
+	 * Set by discriminantv_post_parse. */
+	int carry;
 };
 
 struct discriminant_t* disc_init(struct discriminant_t* t);
@@ -68,10 +78,13 @@ void discriminant_parse(const char* s, struct discriminant_t* disc);
 void discriminantv_post_parse(struct discriminant_t* discv, size_t discc);
 
 #include "digest.h"
+#include "arena.h"
+/* keys are allocated from the arena of the step they belong to */
 size_t key_size(struct discriminant_t* d);
-void* key_alloc(struct discriminant_t* d, size_t* size);
-void* key_new(struct discriminant_t* d, struct stat* st, const char* filename, digest_t* digest, size_t *size);
-void key_delete(void* key);
+void* key_alloc(arena* a, struct discriminant_t* d, size_t* size);
+void* key_new(arena* a, struct discriminant_t* d, finfo_t* fi, const char* filename, digest_t* digest, size_t *size);
+void key_delete(arena* a, void* key);  /** only gives memory back if key was the last allocation */
+uint64_t key_hash(struct discriminant_t* d, long* key, size_t keylen);  /** hash for key2cluster */
 
 #endif
 
@@ -0,0 +1,58 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_FINFO_H
+#define __FILEDEDUP_FINFO_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+/* What is kept of the stat(2) of a file: the fields used by the
+ * discriminants, the catalog and the merge step.  64 bytes, instead of
+ * the 144 of a struct stat. */
+typedef struct finfo_t {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+} finfo_t;
+
+static inline finfo_t* finfo_init(finfo_t* fi, const struct stat* st) { // {{{
+	fi->dev = st->st_dev;
+	fi->ino = st->st_ino;
+	fi->size = st->st_size;
+	fi->mtime = st->st_mtim.tv_sec;
+	fi->mtime_nsec = st->st_mtim.tv_nsec;
+	fi->ctime = st->st_ctim.tv_sec;
+	fi->ctime_nsec = st->st_ctim.tv_nsec;
+	fi->mode = st->st_mode;
+	fi->uid = st->st_uid;
+	fi->gid = st->st_gid;
+	return fi;
+} // }}}
+
+#endif
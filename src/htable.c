@@ -20,221 +20,380 @@
 
 #include "htable.h"
 #include "memory.h"
+#include "arena.h"
 
+#include <sys/types.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
-#define LOAD_FACTOR   8
-#define INITIAL_SIZE 16
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-struct bucket { // {{{
-	bucket* next;
+#define GROUP          16    /** control bytes probed at once         */
+#define MIN_CAPACITY    4    /** small tables use part of a group     */
 
-	void* key;
-	void* data;
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe    /** full slots have the high bit clear   */
 
-	int hval;
-	size_t klen;
-	size_t dlen;
+struct htslot { // {{{
+	union {
+		void* ptr;
+		unsigned char bytes[HTABLE_INLINE_KEY];
+	} key;
+	void* data;
+	uint64_t hash;
+	uint32_t klen;
+	uint32_t dlen;
 }; // }}}
 
-bucket* bucket_new(void* key, size_t klen, void* data, size_t dlen, int hval) { // {{{
-	bucket* ret = (bucket*)calloc(1, sizeof(bucket));
+#define H1(hash)  ((hash) >> 7)
+#define H2(hash)  ((unsigned char)((hash) & 0x7f))
 
-	ret->key = key;
-	ret->klen = klen;
+static uint64_t htable_mix(uint64_t v) { // {{{
+	unsigned __int128 p = (unsigned __int128)v * 0x9E3779B97F4A7C15ULL;
+	return (uint64_t)p ^ (uint64_t)(p >> 64);
+} // }}}
 
-	ret->data = data;
-	ret->dlen = dlen;
+uint64_t htable_hash(const void* key, size_t keylen) { // {{{
 
-	ret->hval = hval;
+	const unsigned char* p = (const unsigned char*)key;
+	uint64_t h = 0x27D4EB2F165667C5ULL ^ keylen;
+	uint64_t w;
 
-	ret->next = NULL;
+	for (; keylen >= sizeof(w); keylen -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = htable_mix(h ^ w);
+	}
 
-	return ret;
+	if (keylen) {
+		w = 0;
+		memcpy(&w, p, keylen);
+		h = htable_mix(h ^ w ^ 0xC2B2AE3D27D4EB4FULL);
+	}
+
+	/* every bit of the key reaches H2() */
+	return htable_hash64(h);
 } // }}}
 
-void* bucket_delete(bucket* b) { // {{{
-	free(b);
-	return b;
+/*****************************************************
+ *
+ * Groups: bit i of the returned masks stands for slot i of the group.
+ * Tables smaller than a group only use its first capacity bytes.
+ *
+ */
+
+static inline unsigned group_limit(htable* ht) { // {{{
+	return ht->capacity < GROUP ? (1U << ht->capacity) - 1 : 0xffff;
 } // }}}
 
-htable* htable_init(htable* ht, size_t estimated_size) { // {{{
+static inline unsigned group_match(const unsigned char* g, unsigned char c) { // {{{
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i*)g);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)c)));
+#else
+	unsigned ret = 0;
+	int i;
+	for (i = 0; i < GROUP; ++i)
+		ret |= (g[i] == c) << i;
+	return ret;
+#endif
+} // }}}
 
-	if (!estimated_size)
-		estimated_size = INITIAL_SIZE;
+/* empty or deleted */
+static inline unsigned group_free(const unsigned char* g) { // {{{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+#else
+	unsigned ret = 0;
+	int i;
+	for (i = 0; i < GROUP; ++i)
+		ret |= (g[i] >> 7) << i;
+	return ret;
+#endif
+} // }}}
 
-	ht->bucketc = estimated_size / LOAD_FACTOR;
-	if (!ht->bucketc)
-		ht->bucketc = 8;
-	ht->bucketv = (bucket**)calloc(ht->bucketc, sizeof(bucket*));
+static inline size_t groupc(htable* ht) { // {{{
+	return ht->capacity < GROUP ? 1 : ht->capacity / GROUP;
+} // }}}
 
-	ht->entries = 0;
-	
-	return ht;
+static inline size_t max_load(size_t capacity) { // {{{
+	return capacity < GROUP ? capacity - 1 : capacity - capacity / 8;
+} // }}}
 
+static inline void* slot_key(htable* ht, htslot* s) { // {{{
+	return ht->inline_klen ? (void*)s->key.bytes : s->key.ptr;
 } // }}}
 
-htable* htable_new(size_t estimated_size) { // {{{
-	return htable_init(calloc(1, sizeof(htable)), estimated_size);
+static inline int slot_eq(htable* ht, htslot* s, void* key, size_t keylen, uint64_t hash) { // {{{
+
+	if ((s->hash != hash) || (s->klen != keylen))
+		return 0;
+
+	if (ht->eq)
+		return ht->eq(slot_key(ht, s), key, keylen);
+
+	return !memcmp(slot_key(ht, s), key, keylen);
 } // }}}
 
-htable* htable_destroy(htable* ht) { // {{{
+/* Probes groups g, g+1, g+3, g+6... which visits all of them */
+#define FOREACH_GROUP(ht, hash, g, i)                                    \
+	for (g = H1(hash) & (groupc(ht) - 1), i = 0;                     \
+	     i < groupc(ht);                                              \
+	     ++i, g = (g + i) & (groupc(ht) - 1))
+
+/* slot index of key, or -1 */
+static ssize_t htable_lookup(htable* ht, void* key, size_t keylen, uint64_t hash) { // {{{
+
+	size_t g, i;
+
+	if (!ht->capacity)
+		return -1;
+
+	FOREACH_GROUP(ht, hash, g, i) {
+
+		const unsigned char* ctrl = ht->ctrl + g * GROUP;
+		unsigned match = group_match(ctrl, H2(hash)) & group_limit(ht);
+
+		while (match) {
+			size_t islot = g * GROUP + __builtin_ctz(match);
+			htslot* s = &ht->slotv[islot];
 
-	size_t i = ht->bucketc;
+			if (slot_eq(ht, s, key, keylen, hash))
+				return islot;
 
-	while (i--) {
-		bucket* head = ht->bucketv[i];
-		while (head) {
-			bucket* next = head->next;
-			bucket_delete(head);
-			head = next;
+			match &= match - 1;
 		}
+
+		/* key would have been stored here */
+		if (group_match(ctrl, CTRL_EMPTY) & group_limit(ht))
+			return -1;
 	}
 
-	ht->entries = 0;
-	ht->bucketc = 0;
-	free(ht->bucketv);
+	return -1;
+} // }}}
+
+static size_t htable_free_slot(htable* ht, uint64_t hash) { // {{{
 
-	return ht;
+	size_t g, i;
 
+	FOREACH_GROUP(ht, hash, g, i) {
+		unsigned avail = group_free(ht->ctrl + g * GROUP) & group_limit(ht);
+		if (avail)
+			return g * GROUP + __builtin_ctz(avail);
+	}
+
+	assert(!"htable without free slots");
+	return 0;
 } // }}}
 
-void htable_delete(htable* ht) { // {{{
-	free(htable_destroy(ht));
+static void htable_alloc(htable* ht, size_t capacity) { // {{{
+
+	ht->capacity = capacity;
+	ht->growth_left = max_load(capacity);
+
+	if (ht->arena) {
+		ht->slotv = (htslot*)arena_alloc(ht->arena, capacity * sizeof(htslot));
+		ht->ctrl = (unsigned char*)arena_alloc(ht->arena, capacity < GROUP ? GROUP : capacity);
+	} else {
+		ht->slotv = (htslot*)malloc(capacity * sizeof(htslot));
+		ht->ctrl = (unsigned char*)malloc(capacity < GROUP ? GROUP : capacity);
+	}
+
+	memset(ht->ctrl, CTRL_EMPTY, capacity < GROUP ? GROUP : capacity);
+
 } // }}}
 
-int htable_hash(void* key, size_t keylen) { // {{{
+/* Moves every entry into a table of the given capacity; deleted slots
+ * are dropped on the way. */
+static void htable_rehash(htable* ht, size_t capacity) { // {{{
 
-	int ret = 0;
-	unsigned* i = (unsigned*)key;
+	htable old = *ht;
+	size_t i;
 
-	while (keylen >= sizeof(unsigned)) {
-		ret *= 33;
-		ret += *i++;
-		keylen -= sizeof(unsigned);
+	htable_alloc(ht, capacity);
+
+	for (i = 0; i < old.capacity; ++i) {
+		if (old.ctrl[i] & 0x80)
+			continue;
+
+		size_t islot = htable_free_slot(ht, old.slotv[i].hash);
+		ht->ctrl[islot] = old.ctrl[i];
+		ht->slotv[islot] = old.slotv[i];
+		--ht->growth_left;
 	}
 
-	unsigned char* c = (unsigned char*)i;
-	while (keylen > 0) {
-		ret *= 33;
-		ret += *c++;
-		keylen--;
+	/* arena tables just leave the old arrays behind */
+	if (!ht->arena) {
+		free(old.ctrl);
+		free(old.slotv);
 	}
 
-	return ret;
 } // }}}
 
-int htable_ibucket(htable* htable, void* key, size_t keylen, int* hval) { // {{{
-	*hval = htable_hash(key, keylen);
-	return *hval % htable->bucketc;
-} // }}}
+static void htable_reserve_one(htable* ht) { // {{{
+
+	if (ht->growth_left)
+		return;
+
+	size_t capacity = ht->capacity ? ht->capacity : MIN_CAPACITY;
+
+	/* grow if live entries fill more than half of it, otherwise
+	 * just get rid of the deleted slots */
+	while (2 * (ht->entries + 1) > max_load(capacity))
+		capacity *= 2;
+
+	htable_rehash(ht, capacity);
 
-int htable_load_factor(htable* ht) { // {{{
-	return ht->entries / ht->bucketc;
 } // }}}
 
-void htable_grow(htable* ht) { // {{{
-	size_t new_bucketc = ht->bucketc * 8;
-	bucket** new_bucketv = (bucket**)calloc(new_bucketc, sizeof(bucket*));
+static void htable_insert(htable* ht, void* key, size_t keylen, void* data, size_t dlen, uint64_t hash) { // {{{
 
-	size_t i = ht->bucketc;
+	htable_reserve_one(ht);
 
-	while (i--) {
-		bucket* head = ht->bucketv[i];
-		while (head) {
-			bucket* next = head->next;
+	size_t islot = htable_free_slot(ht, hash);
 
-			int ibucket = head->hval % new_bucketc;
-			head->next = new_bucketv[ibucket];
-			new_bucketv[ibucket] = head;
-			
-			head = next;
-		}
+	if (ht->ctrl[islot] == CTRL_EMPTY)
+		--ht->growth_left;
+
+	ht->ctrl[islot] = H2(hash);
+
+	htslot* s = &ht->slotv[islot];
+	if (ht->inline_klen) {
+		assert(keylen <= ht->inline_klen);
+		memcpy(s->key.bytes, key, keylen);
+	} else {
+		s->key.ptr = key;
 	}
+	s->klen = keylen;
+	s->data = data;
+	s->dlen = dlen;
+	s->hash = hash;
 
-	free(ht->bucketv);
-	ht->bucketc = new_bucketc;
-	ht->bucketv = new_bucketv;
+	ht->entries++;
 
 } // }}}
 
-bucket** htable_find_pbucket(htable* ht, void* key, size_t keylen, int* hval) { // {{{
+static void htable_presize(htable* ht, size_t estimated_size) { // {{{
 
-	int ibucket = htable_ibucket(ht, key, keylen, hval);
+	if (estimated_size) {
+		size_t capacity = MIN_CAPACITY;
+		while (max_load(capacity) < estimated_size)
+			capacity *= 2;
+		htable_alloc(ht, capacity);
+	}
 
-	bucket** b = &ht->bucketv[ibucket];
+} // }}}
 
-	for (; *b; b = &b[0]->next) {
+htable* htable_init(htable* ht, size_t estimated_size) { // {{{
 
-		if (keylen != b[0]->klen)
-			continue;
+	memset(ht, 0, sizeof(*ht));
+	htable_presize(ht, estimated_size);
 
-		if (!memcmp(key, b[0]->key, keylen))
-			return b;
-	}
+	return ht;
+
+} // }}}
+
+htable* htable_init_arena(htable* ht, size_t estimated_size, struct arena* a) { // {{{
 
-	return b;
+	memset(ht, 0, sizeof(*ht));
+	ht->arena = a;
+	htable_presize(ht, estimated_size);
+
+	return ht;
 
 } // }}}
 
-int htable_add(htable* ht, void* key, size_t keylen, void* data, size_t dlen) { // {{{
+htable* htable_init_typed(htable* ht, size_t estimated_size, size_t inline_klen, htable_eq_fn eq) { // {{{
+
+	assert(inline_klen <= HTABLE_INLINE_KEY);
+
+	htable_init(ht, estimated_size);
+	ht->inline_klen = inline_klen;
+	ht->eq = eq;
 
-	if (htable_load_factor(ht) > LOAD_FACTOR)
-		htable_grow(ht);
+	return ht;
+} // }}}
 
-	int hval;
+htable* htable_new(size_t estimated_size) { // {{{
+	return htable_init(calloc(1, sizeof(htable)), estimated_size);
+} // }}}
 
-	bucket** b = htable_find_pbucket(ht, key, keylen, &hval);
+htable* htable_destroy(htable* ht) { // {{{
 
-	if (*b)
-		return HTABLE_NOT_FOUND;
+	if (!ht->arena) {
+		free(ht->ctrl);
+		free(ht->slotv);
+	}
 
-	*b = bucket_new(key, keylen, data, dlen, hval);
+	memset(ht, 0, sizeof(*ht));
 
-	ht->entries++;
+	return ht;
+
+} // }}}
+
+void htable_delete(htable* ht) { // {{{
+	free(htable_destroy(ht));
+} // }}}
+
+int htable_add(htable* ht, void* key, size_t keylen, void* data, size_t dlen) { // {{{
+	return htable_add_h(ht, key, keylen, data, dlen, htable_hash(key, keylen));
+} // }}}
+
+int htable_add_h(htable* ht, void* key, size_t keylen, void* data, size_t dlen, uint64_t hash) { // {{{
+
+	if (htable_lookup(ht, key, keylen, hash) >= 0)
+		return HTABLE_NOT_FOUND;
+
+	htable_insert(ht, key, keylen, data, dlen, hash);
 
 	return HTABLE_FOUND;
 } // }}}
 
 void htable_set(htable* ht, void* key, size_t keylen, void* data, size_t dlen) { // {{{
+	htable_set_h(ht, key, keylen, data, dlen, htable_hash(key, keylen));
+} // }}}
 
-	if (htable_load_factor(ht) > LOAD_FACTOR)
-		htable_grow(ht);
+void htable_set_h(htable* ht, void* key, size_t keylen, void* data, size_t dlen, uint64_t hash) { // {{{
 
-	int hval;
-	bucket** b = htable_find_pbucket(ht, key, keylen, &hval);
+	ssize_t islot = htable_lookup(ht, key, keylen, hash);
 
-	if (*b) {
-		free(b[0]->data);
-		b[0]->data = xmemdup(data, dlen);
-		b[0]->dlen = dlen;
+	if (islot >= 0) {
+		htslot* s = &ht->slotv[islot];
+		free(s->data);
+		s->data = xmemdup(data, dlen);
+		s->dlen = dlen;
 	} else {
-
-		*b = bucket_new(key, keylen, data, dlen, hval);
-
-		ht->entries++;
+		htable_insert(ht, key, keylen, data, dlen, hash);
 	}
 
 } // }}}
 
 int htable_unset(htable* ht, void* key, size_t keylen, void** data, size_t *dlen) { // {{{
+	return htable_unset_h(ht, key, keylen, htable_hash(key, keylen), data, dlen);
+} // }}}
 
-	int hval;
-	bucket** b = htable_find_pbucket(ht, key, keylen, &hval);
+int htable_unset_h(htable* ht, void* key, size_t keylen, uint64_t hash, void** data, size_t *dlen) { // {{{
 
-	if (!*b)
-		return HTABLE_NOT_FOUND;
+	ssize_t islot = htable_lookup(ht, key, keylen, hash);
 
-	bucket* next = b[0]->next;
+	if (islot < 0)
+		return HTABLE_NOT_FOUND;
 
-	*data = b[0]->data;
-	*dlen = b[0]->dlen;
-	b[0]->data = NULL;
+	*data = ht->slotv[islot].data;
+	*dlen = ht->slotv[islot].dlen;
 
-	bucket_delete(*b);
+	/* No lookup went past a group with an empty slot, so this one can
+	 * be emptied too; otherwise it must be left as a tombstone. */
+	const unsigned char* ctrl = ht->ctrl + (islot & ~(size_t)(GROUP - 1));
 
-	*b = next;
+	if (group_match(ctrl, CTRL_EMPTY) & group_limit(ht)) {
+		ht->ctrl[islot] = CTRL_EMPTY;
+		++ht->growth_left;
+	} else {
+		ht->ctrl[islot] = CTRL_DELETED;
+	}
 
 	ht->entries--;
 
@@ -242,33 +401,34 @@ int htable_unset(htable* ht, void* key, size_t keylen, void** data, size_t *dlen
 } // }}}
 
 int htable_find(htable* ht, void* key, size_t keylen, void** data, size_t *dlen) { // {{{
+	return htable_find_h(ht, key, keylen, htable_hash(key, keylen), data, dlen);
+} // }}}
 
-	int hval;
-	bucket** b = htable_find_pbucket(ht, key, keylen, &hval);
+int htable_find_h(htable* ht, void* key, size_t keylen, uint64_t hash, void** data, size_t *dlen) { // {{{
 
-	if (!*b)
+	ssize_t islot = htable_lookup(ht, key, keylen, hash);
+
+	if (islot < 0)
 		return HTABLE_NOT_FOUND;
 
-	*data = b[0]->data;
-	*dlen = b[0]->dlen;
+	*data = ht->slotv[islot].data;
+	*dlen = ht->slotv[islot].dlen;
 
 	return HTABLE_FOUND;
 } // }}}
 
 void htable_foreach(htable* ht, htforeach htfe, void* cbdata) { // {{{
 
-	size_t i = ht->bucketc;
-
-	while (i--) {
+	size_t i = 0;
 
-		bucket* b = ht->bucketv[i];
+	for (; i < ht->capacity; ++i) {
 
-		while (b) {
-			if (htfe(b->key, b->klen, b->data, b->dlen, cbdata) < 0)
-				return;
-			b = b->next;
-		}
+		if (ht->ctrl[i] & 0x80)
+			continue;
 
+		htslot* s = &ht->slotv[i];
+		if (htfe(slot_key(ht, s), s->klen, s->data, s->dlen, cbdata) < 0)
+			return;
 	}
 } // }}}
 
@@ -276,18 +436,19 @@ void htable_bucketc(htable* ht, unsigned* countv, size_t countc) { // {{{
 
 	memset(countv, 0, sizeof(countv[0]) * countc);
 
-	size_t i = ht->bucketc;
+	size_t islot = 0;
 
-	while (i--) {
-		
-		bucket* b = ht->bucketv[i];
-		unsigned cnt = 0;
+	for (; islot < ht->capacity; ++islot) {
 
-		while (b) {
-			b = b->next;
-			++cnt;
-		}
+		if (ht->ctrl[islot] & 0x80)
+			continue;
 
+		size_t g, i;
+		FOREACH_GROUP(ht, ht->slotv[islot].hash, g, i)
+			if (g == islot / GROUP)
+				break;
+
+		unsigned cnt = i + 1;
 		if (cnt >= countc)
 			cnt = countc-1;
 
@@ -295,5 +456,3 @@ void htable_bucketc(htable* ht, unsigned* countv, size_t countc) { // {{{
 	}
 
 } // }}}
-
-
@@ -22,20 +22,37 @@
 #define __FILEDEDUP_HTABLE_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #define HTABLE_FOUND      0
 #define HTABLE_NOT_FOUND -1
 
-typedef struct bucket bucket;
+/* Open addressing, in the style of Swiss tables: each slot has a control
+ * byte (empty, deleted, or 7 bits of the hash of its key), and probing
+ * checks a group of 16 control bytes at once. */
+
+#define HTABLE_INLINE_KEY 16  /** longest key that can be kept in the slot */
+
+typedef struct htslot htslot;
+
+/* key equality, for keys of the same length; NULL: memcmp */
+typedef int (*htable_eq_fn)(const void* a, const void* b, size_t keylen);
 
 typedef struct htable {
-	bucket** bucketv; /** array of buckets  */
-	size_t bucketc;   /** number of buckets */
-	size_t entries;   /** number of entries */
+	unsigned char* ctrl; /** control bytes, one per slot   */
+	htslot* slotv;       /** slots                         */
+	size_t capacity;     /** number of slots (power of 2)  */
+	size_t growth_left;  /** inserts left before a rehash  */
+	size_t entries;      /** number of entries             */
+	size_t inline_klen;  /** keys are copied into the slots; 0: kept by pointer */
+	htable_eq_fn eq;
+	struct arena* arena; /** slots come from here, and are never freed; NULL: malloc */
 } htable;
 
 htable* htable_init(htable* ht, size_t estimated_size); /** alloc && init a htable  */
 htable* htable_new(size_t estimated_size);              /** alloc && init a htable  */
+htable* htable_init_arena(htable* ht, size_t estimated_size, struct arena* a);
+htable* htable_init_typed(htable* ht, size_t estimated_size, size_t inline_klen, htable_eq_fn eq);
 htable* htable_destroy(htable*);                        /** destroy an htable       */
 void htable_delete(htable*);                            /** destroy and free htable */
 
@@ -47,7 +64,25 @@ int htable_unset(htable* ht, void* key, size_t keylen, void** data, size_t *dlen
 int htable_find(htable* htable, void* key, size_t keylen, void** data, size_t *dlen);
 void htable_foreach(htable* ht, htforeach htfe, void* cbdata);  /** stops when htfe returns < 0 */
 
-void htable_bucketc(htable* ht, unsigned* countv, size_t countc);
+void htable_bucketc(htable* ht, unsigned* countv, size_t countc); /** histogram of groups probed per entry */
+
+/* The same, given the hash of the key (see htable_hash()) */
+int htable_add_h(htable* ht, void* key, size_t keylen, void* data, size_t dlen, uint64_t hash);
+void htable_set_h(htable* ht, void* key, size_t keylen, void* data, size_t dlen, uint64_t hash);
+int htable_unset_h(htable* ht, void* key, size_t keylen, uint64_t hash, void** data, size_t *dlen);
+int htable_find_h(htable* ht, void* key, size_t keylen, uint64_t hash, void** data, size_t *dlen);
+
+uint64_t htable_hash(const void* key, size_t keylen);  /** the default hash */
+
+/* finalizer of MurmurHash3: spreads a 64 bits value over all bits */
+static inline uint64_t htable_hash64(uint64_t h) { // {{{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+} // }}}
 
 #include <assert.h>
 
@@ -86,6 +121,47 @@ int short_name##_find(htable* ht, key_type* key, value_type** data) {
 } /* }}} */
 
 
+/* H = hashed by hash_fn(key_type*), compared by eq_fn (NULL: memcmp).
+ * Keys up to HTABLE_INLINE_KEY bytes are copied into the table, so the
+ * caller keeps ownership of the key it passes. */
+
+#define DECLARE_HTABLE_TYPE_H(short_name, key_type, value_type)        /* {{{ */         \
+DECLARE_HTABLE_TYPE(short_name, key_type, value_type)                                    \
+htable* short_name##_init(htable* ht, size_t estimated_size); /* }}} */
+
+#define DEFINE_HTABLE_TYPE_H(short_name, key_type, value_type, hash_fn, eq_fn) /* {{{ */ \
+                                                                                         \
+htable* short_name##_init(htable* ht, size_t estimated_size) {                           \
+	return htable_init_typed(ht, estimated_size,                                     \
+			sizeof(key_type) <= HTABLE_INLINE_KEY ? sizeof(key_type) : 0,    \
+			(htable_eq_fn)(eq_fn));                                          \
+}                                                                                        \
+                                                                                         \
+int short_name##_add(htable* ht, key_type* key, value_type* data) {                      \
+	return htable_add_h(ht, key, sizeof(*key), data, sizeof(*data), hash_fn(key));   \
+}                                                                                        \
+                                                                                         \
+void short_name##_set(htable* ht, key_type* key, value_type* data) {                     \
+	htable_set_h(ht, key, sizeof(*key), data, sizeof(*data), hash_fn(key));          \
+}                                                                                        \
+                                                                                         \
+int short_name##_unset(htable* ht, key_type* key, value_type** data) {                   \
+        size_t size = 0;                                                                 \
+	int ret = htable_unset_h(ht, key, sizeof(*key), hash_fn(key), (void**)data, &size); \
+	if (ret == HTABLE_FOUND)                                                         \
+		assert(size == sizeof(value_type));                                      \
+	return ret;                                                                      \
+}                                                                                        \
+                                                                                         \
+int short_name##_find(htable* ht, key_type* key, value_type** data) {                    \
+        size_t size = 0;                                                                 \
+	int ret = htable_find_h(ht, key, sizeof(*key), hash_fn(key), (void**)data, &size); \
+	if (ret == HTABLE_FOUND)                                                         \
+		assert(size == sizeof(value_type));                                      \
+	return ret;                                                                      \
+} /* }}} */
+
+
 /* KL = key length, variable length keys */
 
 #define DECLARE_HTABLE_TYPE_KL(short_name, key_type, value_type)                          /* {{{ */     \
@@ -121,5 +197,42 @@ int short_name##_find(htable* ht, key_type* key, size_t keylen, value_type** dat
 	return ret;                                                                      \
 } /* }}} */
 
+
+/* KL_H = variable length keys, hashed by hash_fn(key_type*, size_t keylen) */
+
+#define DECLARE_HTABLE_TYPE_KL_H(short_name, key_type, value_type)     /* {{{ */         \
+DECLARE_HTABLE_TYPE_KL(short_name, key_type, value_type)                                 \
+htable* short_name##_init(htable* ht, size_t estimated_size); /* }}} */
+
+#define DEFINE_HTABLE_TYPE_KL_H(short_name, key_type, value_type, hash_fn, eq_fn) /* {{{ */ \
+                                                                                         \
+htable* short_name##_init(htable* ht, size_t estimated_size) {                           \
+	return htable_init_typed(ht, estimated_size, 0, (htable_eq_fn)(eq_fn));         \
+}                                                                                        \
+                                                                                         \
+int short_name##_add(htable* ht, key_type* key, size_t keylen, value_type* data) {       \
+	return htable_add_h(ht, key, keylen, data, sizeof(*data), hash_fn(key, keylen)); \
+}                                                                                        \
+                                                                                         \
+void short_name##_set(htable* ht, key_type* key, size_t keylen, value_type* data) {      \
+	htable_set_h(ht, key, keylen, data, sizeof(*data), hash_fn(key, keylen));        \
+}                                                                                        \
+                                                                                         \
+int short_name##_unset(htable* ht, key_type* key, size_t keylen, value_type** data) {    \
+        size_t size = 0;                                                                 \
+	int ret = htable_unset_h(ht, key, keylen, hash_fn(key, keylen), (void**)data, &size); \
+	if (ret == HTABLE_FOUND)                                                         \
+		assert(size == sizeof(value_type));                                      \
+	return ret;                                                                      \
+}                                                                                        \
+                                                                                         \
+int short_name##_find(htable* ht, key_type* key, size_t keylen, value_type** data) {     \
+        size_t size = 0;                                                                 \
+	int ret = htable_find_h(ht, key, keylen, hash_fn(key, keylen), (void**)data, &size); \
+	if (ret == HTABLE_FOUND)                                                         \
+		assert(size == sizeof(value_type));                                      \
+	return ret;                                                                      \
+} /* }}} */
+
 #endif
 
@@ -0,0 +1,391 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "iosched.h"
+#include "config.h"
+#include "error.h"
+
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct iosched_dev { // {{{
+	uint64_t dev;
+	size_t* idxv;       /** items of the device, in the order given */
+	size_t idxc;
+	size_t next;        /** next one to hand out */
+	size_t prefetched;  /** items up to here were prefetched */
+	int inflight;
+	int depth;
+} iosched_dev; // }}}
+
+typedef struct iosched_queue { // {{{
+	void** itemv;
+	iosched_dev* devv;
+	size_t devc;
+	size_t rr;          /** device to look at first */
+	size_t left;        /** items not handed out yet */
+	iosched_prefetch_fn prefetch;
+	size_t window;      /** --prefetch */
+	job_fn fn;
+	void* cbdata;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} iosched_queue; // }}}
+
+typedef struct iosched_idx { // {{{
+	uint64_t dev;
+	uint64_t pos;       /** where on the device, with --order */
+	uint64_t ino;
+	int mapped;         /** pos is a physical offset */
+	size_t i;
+} iosched_idx; // }}}
+
+/* devices seen so far, and whether they are rotational */
+static struct {
+	uint64_t* devv;
+	char* rotv;
+	size_t devc;
+} _known = { NULL, NULL, 0 };
+
+static int sysfs_rotational(uint64_t dev) { // {{{
+
+	static const char* fmtv[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational",  /* partition */
+		NULL
+	};
+
+	const char** fmt = fmtv;
+
+	for (; *fmt; ++fmt) {
+		char path[128];
+		snprintf(path, sizeof(path), *fmt, major(dev), minor(dev));
+
+		FILE* f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		int c = fgetc(f);
+		fclose(f);
+		return c == '1';
+	}
+
+	return 0;
+} // }}}
+
+int iosched_depth(uint64_t dev) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	size_t i;
+
+	for (i = 0; i < _known.devc; ++i)
+		if (_known.devv[i] == dev)
+			break;
+
+	if (i == _known.devc) {
+		_known.devv = (uint64_t*)realloc(_known.devv, (i + 1) * sizeof(_known.devv[0]));
+		_known.rotv = (char*)realloc(_known.rotv, i + 1);
+		_known.devv[i] = dev;
+		_known.rotv[i] = sysfs_rotational(dev);
+		_known.devc++;
+
+		debug("Device %u:%u: %s, %u readers at most.", major(dev), minor(dev),
+			_known.rotv[i] ? "rotational" : "solid state",
+			_known.rotv[i] ? cfg->io_depth_rot : cfg->io_depth_ssd);
+	}
+
+	return _known.rotv[i] ? cfg->io_depth_rot : cfg->io_depth_ssd;
+} // }}}
+
+static int idx_cmp(const void* _a, const void* _b) { // {{{
+
+	const iosched_idx* a = (const iosched_idx*)_a;
+	const iosched_idx* b = (const iosched_idx*)_b;
+
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+
+	if (a->pos != b->pos)
+		return a->pos < b->pos ? -1 : 1;
+
+	return a->i < b->i ? -1 : a->i > b->i;
+} // }}}
+
+/*****************************************************
+ *
+ * Physical order
+ *
+ */
+
+/* physical offset of the first extent; -1 if FIEMAP is not available */
+static int first_extent(const char* filename, uint64_t* pos) { // {{{
+
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe;
+	} map;
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&map, 0, sizeof(map));
+	map.fm.fm_start = 0;
+	map.fm.fm_length = FIEMAP_MAX_OFFSET;
+	map.fm.fm_extent_count = 1;
+
+	int ret = ioctl(fd, FS_IOC_FIEMAP, &map.fm);
+	close(fd);
+
+	if (ret < 0)
+		return -1;
+
+	/* holes, inline data and delayed allocation go first */
+	if (!map.fm.fm_mapped_extents || (map.fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+		*pos = 0;
+	else
+		*pos = map.fe.fe_physical;
+
+	return 0;
+} // }}}
+
+typedef struct iosched_order_ctx { // {{{
+	void** itemv;
+	iosched_path_fn path;
+} iosched_order_ctx; // }}}
+
+static void extentJob(void* item, void* cbdata) { // {{{
+
+	iosched_idx* x = (iosched_idx*)item;
+	iosched_order_ctx* ctx = (iosched_order_ctx*)cbdata;
+	char* filename = ctx->path(ctx->itemv[x->i]);
+
+	x->mapped = first_extent(filename, &x->pos) == 0;
+	free(filename);
+} // }}}
+
+/* idx[0, itemc) with dev, ino and i set: sets pos, and sorts it */
+static void order_idx(iosched_idx* idx, size_t itemc, void** itemv, iosched_path_fn path) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	size_t i, start;
+
+	for (i = 0; i < itemc; ++i)
+		idx[i].pos = 0;
+
+	if (cfg->order == 'f') {
+		/* an open(2) each, so spread among the jobs */
+		void** xv = (void**)malloc(itemc * sizeof(xv[0]));
+		iosched_order_ctx ctx = { itemv, path };
+
+		for (i = 0; i < itemc; ++i)
+			xv[i] = &idx[i];
+		jobs_run(xv, itemc, extentJob, &ctx);
+		free(xv);
+
+		qsort(idx, itemc, sizeof(idx[0]), idx_cmp);
+
+		/* a device where FIEMAP failed is ordered by inode */
+		for (start = 0; start < itemc; start = i) {
+			int mapped = 1;
+
+			for (i = start; (i < itemc) && (idx[i].dev == idx[start].dev); ++i)
+				mapped &= idx[i].mapped;
+
+			if (mapped)
+				continue;
+
+			debug("Device %u:%u: no FIEMAP, reading in inode order.", major(idx[start].dev), minor(idx[start].dev));
+			for (i = start; (i < itemc) && (idx[i].dev == idx[start].dev); ++i)
+				idx[i].pos = idx[i].ino;
+			qsort(idx + start, i - start, sizeof(idx[0]), idx_cmp);
+		}
+
+	} else {
+		if (cfg->order == 'i')
+			for (i = 0; i < itemc; ++i)
+				idx[i].pos = idx[i].ino;
+
+		qsort(idx, itemc, sizeof(idx[0]), idx_cmp);
+	}
+} // }}}
+
+void iosched_order(void** itemv, size_t itemc, iosched_key_fn key, iosched_path_fn path) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	if (cfg->order == 'n')
+		return;
+
+	iosched_idx* idx = (iosched_idx*)malloc(itemc * sizeof(idx[0]));
+	void** sorted = (void**)malloc(itemc * sizeof(sorted[0]));
+	size_t i;
+
+	for (i = 0; i < itemc; ++i) {
+		key(itemv[i], &idx[i].dev, &idx[i].ino);
+		idx[i].i = i;
+	}
+
+	order_idx(idx, itemc, itemv, path);
+
+	for (i = 0; i < itemc; ++i)
+		sorted[i] = itemv[idx[i].i];
+	memcpy(itemv, sorted, itemc * sizeof(itemv[0]));
+
+	free(sorted);
+	free(idx);
+} // }}}
+
+static void* iosched_worker(void* _q) { // {{{
+
+	iosched_queue* q = (iosched_queue*)_q;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->left) {
+		iosched_dev* d = NULL;
+		size_t k;
+
+		for (k = 0; k < q->devc; ++k) {
+			iosched_dev* dk = &q->devv[(q->rr + k) % q->devc];
+			if ((dk->next < dk->idxc) && (dk->inflight < dk->depth)) {
+				d = dk;
+				q->rr = (q->rr + k + 1) % q->devc;
+				break;
+			}
+		}
+
+		/* every device with items left is at its limit */
+		if (!d) {
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+
+		void* item = q->itemv[d->idxv[d->next++]];
+		d->inflight++;
+		q->left--;
+
+		/* keeps the next --prefetch items of the device on their way */
+		size_t from = d->prefetched > d->next ? d->prefetched : d->next;
+		size_t to = from;
+
+		if (q->prefetch) {
+			to = d->next + q->window;
+			if (to > d->idxc)
+				to = d->idxc;
+			if (to < from)
+				to = from;
+			d->prefetched = to;
+		}
+
+		pthread_mutex_unlock(&q->lock);
+
+		for (; from < to; ++from)
+			q->prefetch(q->itemv[d->idxv[from]]);
+
+		q->fn(item, q->cbdata);
+		pthread_mutex_lock(&q->lock);
+
+		d->inflight--;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+} // }}}
+
+/*****************************************************
+ *
+ * Per device queues
+ *
+ */
+
+void iosched_run(void** itemv, size_t itemc, iosched_key_fn key, iosched_prefetch_fn prefetch, job_fn fn, void* cbdata) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	iosched_queue q;
+	iosched_idx* idx = (iosched_idx*)malloc(itemc * sizeof(idx[0]));
+	size_t* idxv = (size_t*)malloc(itemc * sizeof(idxv[0]));
+	size_t threads = 0;
+	size_t i;
+
+	memset(&q, 0, sizeof(q));
+
+	/* by device, in the order given: iosched_order() did the rest */
+	for (i = 0; i < itemc; ++i) {
+		key(itemv[i], &idx[i].dev, &idx[i].ino);
+		idx[i].pos = 0;
+		idx[i].i = i;
+	}
+
+	qsort(idx, itemc, sizeof(idx[0]), idx_cmp);
+
+	for (i = 0; i < itemc; ++i) {
+		idxv[i] = idx[i].i;
+
+		if (!i || (idx[i].dev != idx[i - 1].dev)) {
+			q.devv = (iosched_dev*)realloc(q.devv, (q.devc + 1) * sizeof(q.devv[0]));
+			memset(&q.devv[q.devc], 0, sizeof(q.devv[0]));
+			q.devv[q.devc].dev = idx[i].dev;
+			q.devv[q.devc].idxv = &idxv[i];
+			q.devv[q.devc].depth = iosched_depth(idx[i].dev);
+			q.devc++;
+		}
+
+		q.devv[q.devc - 1].idxc++;
+	}
+
+	free(idx);
+
+	/* no more threads than can be reading at once */
+	for (i = 0; i < q.devc; ++i)
+		threads += (q.devv[i].idxc < (size_t)q.devv[i].depth) ? q.devv[i].idxc : (size_t)q.devv[i].depth;
+	if (threads > (size_t)cfg->jobs)
+		threads = cfg->jobs;
+
+	q.itemv = itemv;
+	q.left = itemc;
+	q.prefetch = cfg->prefetch ? prefetch : NULL;
+	q.window = cfg->prefetch;
+	q.fn = fn;
+	q.cbdata = cbdata;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	if (threads)
+		jobs_threads(threads, iosched_worker, &q);
+
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+	free(q.devv);
+	free(idxv);
+
+} // }}}
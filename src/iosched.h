@@ -0,0 +1,68 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_IOSCHED_H
+#define __FILEDEDUP_IOSCHED_H
+
+#include "jobs.h"
+
+#include <stdint.h>
+
+/*****************************************************
+ *
+ * Per device I/O scheduling
+ *
+ * iosched_run() works as jobs_run(), but the items are first grouped by
+ * the device they read from, and each device gets a queue of its own
+ * with a limit of readers at once: config()->io_depth_rot for rotational
+ * disks (a single reader, so the head doesn't seek between files) and
+ * config()->io_depth_ssd for the others.  Up to config()->jobs threads
+ * take items from whichever device is below its limit, in turns, so
+ * that a slow disk does not hold back the fast ones.
+ *
+ * With --prefetch N, the kernel is asked to start reading the next N
+ * items of each device (prefetch(item)) before they are handed out, so
+ * that their first chunk is being read while the current ones are
+ * hashed.
+ *
+ * Whether a device is rotational is read from
+ * /sys/dev/block/<major>:<minor>/queue/rotational (or the one of the
+ * whole disk, for a partition); devices without it (network, virtual
+ * filesystems) are taken as solid state.
+ *
+ * iosched_order() sorts items by device and then, with --order, by
+ * where they are on the device: the physical offset of their first
+ * extent (FS_IOC_FIEMAP), or their inode number where FIEMAP is not
+ * supported (or with --order=inode).  Reading them in that order, the
+ * head sweeps the disk instead of seeking back and forth.
+ *
+ */
+
+typedef void (*iosched_key_fn)(void* item, uint64_t* dev, uint64_t* ino);
+typedef char* (*iosched_path_fn)(void* item);   /** malloc'd */
+typedef void (*iosched_prefetch_fn)(void* item);
+
+void iosched_order(void** itemv, size_t itemc, iosched_key_fn key, iosched_path_fn path);
+
+/* prefetch may be NULL */
+void iosched_run(void** itemv, size_t itemc, iosched_key_fn key, iosched_prefetch_fn prefetch, job_fn fn, void* cbdata);
+
+int iosched_depth(uint64_t dev);   /** readers allowed at once on dev */
+
+#endif
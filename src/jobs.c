@@ -0,0 +1,180 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "jobs.h"
+#include "queue.h"
+#include "config.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct jobs_queue {
+	void** itemv;
+	size_t itemc;
+	size_t next;      /** next item to hand out */
+	job_fn fn;
+	void* cbdata;
+	pthread_mutex_t lock;
+} jobs_queue;
+
+static pthread_mutex_t _state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void jobs_lock() { // {{{
+	pthread_mutex_lock(&_state_lock);
+} // }}}
+
+void jobs_unlock() { // {{{
+	pthread_mutex_unlock(&_state_lock);
+} // }}}
+
+static void* jobs_worker(void* _q) { // {{{
+
+	jobs_queue* q = (jobs_queue*)_q;
+
+	while (1) {
+		pthread_mutex_lock(&q->lock);
+		size_t i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->itemc)
+			break;
+
+		q->fn(q->itemv[i], q->cbdata);
+	}
+
+	return NULL;
+} // }}}
+
+void jobs_threads(int threads, void* (*worker)(void*), void* arg) { // {{{
+
+	pthread_t tidv[MAX_JOBS];
+	int tidc = 0;
+
+	if (threads > MAX_JOBS)
+		threads = MAX_JOBS;
+
+	/* the calling thread is the last worker */
+	while (tidc < threads - 1) {
+		int err = pthread_create(&tidv[tidc], NULL, worker, arg);
+		if (err) {
+			warning("Could not start worker thread: %s.\n", strerror(err));
+			break;
+		}
+		++tidc;
+	}
+
+	worker(arg);
+
+	while (tidc--)
+		pthread_join(tidv[tidc], NULL);
+
+} // }}}
+
+void jobs_run(void** itemv, size_t itemc, job_fn fn, void* cbdata) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	jobs_queue q;
+	int jobs = cfg->jobs;
+
+	if (jobs > itemc)
+		jobs = itemc;
+
+	if (jobs <= 1) {
+		size_t i = 0;
+		for (; i < itemc; ++i)
+			fn(itemv[i], cbdata);
+		return;
+	}
+
+	q.itemv = itemv;
+	q.itemc = itemc;
+	q.next = 0;
+	q.fn = fn;
+	q.cbdata = cbdata;
+	pthread_mutex_init(&q.lock, NULL);
+
+	jobs_threads(jobs, jobs_worker, &q);
+
+	pthread_mutex_destroy(&q.lock);
+
+} // }}}
+
+struct jobs_stage { // {{{
+	queue_t queue;
+	job_fn fn;
+	void* cbdata;
+	pthread_t tidv[MAX_JOBS];
+	int tidc;
+}; // }}}
+
+static void* jobs_stage_worker(void* _stage) { // {{{
+
+	jobs_stage* stage = (jobs_stage*)_stage;
+	void* item;
+
+	while (queue_pop(&stage->queue, &item))
+		stage->fn(item, stage->cbdata);
+
+	return NULL;
+} // }}}
+
+jobs_stage* jobs_stage_new(int threads, size_t queue_size, job_fn fn, void* cbdata) { // {{{
+
+	jobs_stage* stage = (jobs_stage*)calloc(1, sizeof(jobs_stage));
+
+	queue_init(&stage->queue, queue_size);
+	stage->fn = fn;
+	stage->cbdata = cbdata;
+
+	if (threads > MAX_JOBS)
+		threads = MAX_JOBS;
+
+	while (stage->tidc < threads) {
+		int err = pthread_create(&stage->tidv[stage->tidc], NULL, jobs_stage_worker, stage);
+		if (err) {
+			warning("Could not start worker thread: %s.\n", strerror(err));
+			break;
+		}
+		++stage->tidc;
+	}
+
+	if (!stage->tidc)
+		fatal("No thread to run a pipeline stage.\n");
+
+	return stage;
+} // }}}
+
+void jobs_stage_push(jobs_stage* stage, void* item) { // {{{
+	queue_push(&stage->queue, item);
+} // }}}
+
+void jobs_stage_finish(jobs_stage* stage) { // {{{
+
+	queue_close(&stage->queue);
+
+	while (stage->tidc--)
+		pthread_join(stage->tidv[stage->tidc], NULL);
+
+	queue_destroy(&stage->queue);
+	free(stage);
+
+} // }}}
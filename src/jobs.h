@@ -0,0 +1,64 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_JOBS_H
+#define __FILEDEDUP_JOBS_H
+
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * Worker pool
+ *
+ * jobs_run() calls fn(itemv[i], cbdata) for every item, using up to
+ * config()->jobs threads (the calling one included).  Items are handed
+ * out one at a time, so big and small files balance among the workers.
+ * It returns once every item has been processed.
+ *
+ */
+
+typedef void (*job_fn)(void* item, void* cbdata);
+
+void jobs_run(void** itemv, size_t itemc, job_fn fn, void* cbdata);
+
+/* runs worker(arg) on threads threads, the calling one included */
+void jobs_threads(int threads, void* (*worker)(void*), void* arg);
+
+/*****************************************************
+ *
+ * Pipeline stages
+ *
+ * A stage is a number of threads calling fn(item, cbdata) on the items
+ * pushed to it, through a bounded queue: a stage that runs ahead of the
+ * next one waits for it in jobs_stage_push().  jobs_stage_finish() waits
+ * for every item pushed to be processed, and deletes the stage.
+ *
+ */
+
+typedef struct jobs_stage jobs_stage;
+
+jobs_stage* jobs_stage_new(int threads, size_t queue_size, job_fn fn, void* cbdata);
+void jobs_stage_push(jobs_stage* stage, void* item);
+void jobs_stage_finish(jobs_stage* stage);
+
+/* Serializes access to the shared run state (tables, report, counters). */
+void jobs_lock();
+void jobs_unlock();
+
+#endif
@@ -29,6 +29,14 @@
 #include "error.h"
 #include "string.h"
 #include "discriminant.h"
+#include "jobs.h"
+#include "walk.h"
+#include "compare.h"
+#include "catalog.h"
+#include "pathstore.h"
+#include "sizefilter.h"
+#include "spill.h"
+#include "iosched.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -47,7 +55,7 @@ void help() { // {{{
   );
 } // }}}
 
-char* tempfile(char* base) {
+char* tempfile(const char* base) {
 	char* tmp = NULL;
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -55,78 +63,227 @@ char* tempfile(char* base) {
 	return tmp;
 }
 
-void _process_file(const char* filename, struct stat* _st) { // {{{
+/* In the functions below, path is filename in the path store, or NULL if
+ * it was not interned yet (walk, step 0). */
+
+/* if <dev,ino> is already in the set, we already scanned the hardlink to
+ * this file.  Must be called with the state lock held. */
+static int _process_hardlink(const path_t* path, const char* filename, finfo_t* fi) { // {{{
 
-	CACHED_CONFIG(cfg);
 	CACHED_STATE(st);
 
-	// if <dev,ino> is already in the set, we already scanned the hardlink to this file
 	devino_t devino;
-	file_t* file = NULL;
 	file_t* found = NULL;
-	cluster_t* cluster = NULL;
-	size_t keylen = 0;
-	long* key = NULL;
 
-	devino_init(&devino, _st->st_dev, _st->st_ino);
+	devino_init(&devino, fi->dev, fi->ino);
+
+	if (devino2file_find(&st->filesByDevIno, &devino, &found) != HTABLE_FOUND)
+		return 0;
+
+	cluster_t* cluster = found->cluster;
+	file_t* file = file_new(&st->mem, path, filename, fi, cluster);
+	cluster_add(cluster, &st->mem, file);
+	debug("\tFile %s (%lu bytes): found in devino (dev=%x, ino=%ld)", filename, fi->size,
+			devino.dev, devino.inode);
+
+	return 1;
+} // }}}
+
+/* Classifies the file if it's a hardlink of one already seen in this
+ * step.  Otherwise returns 1, and its digest is needed for
+ * _process_file_end().  Takes the state lock. */
+int _process_file_begin(const path_t* path, const char* filename, finfo_t* fi) { // {{{
+
+	CACHED_CONFIG(cfg);
 
 	if (link_type_is_symb(cfg->flags) && (filename[0] != '/'))
 		fatal("Merging via symlinks with relative paths is not an option.\n");
 
-	if (!_st->st_size) {
+	if (!fi->size) {
 		debug("\tFile %s empty, ignoring.", filename);
-		return;
+		return 0;
 	}
 
-	if (devino2file_find(&st->filesByDevIno, &devino, &found) == HTABLE_FOUND) {
-		cluster = found->cluster;
-		key = found->key;
-		file = file_new(filename, _st, found->cluster);
-		clfiles_add(&cluster->files, strdup(filename), strlen(filename)+1, file);
-		debug("\tFile %s (%lu bytes): found in devino (dev=%x, ino=%ld)", filename, _st->st_size,
-				devino.dev, devino.inode);
+	jobs_lock();
+	int ret = !_process_hardlink(path, filename, fi);
+	jobs_unlock();
+
+	return ret;
+} // }}}
+
+/* Adds the file to the cluster of key (which is taken: it must be the
+ * last allocation of the step arena).  Must be called with the state
+ * lock held. */
+static void _add_file(const path_t* path, const char* filename, finfo_t* fi, long* key, size_t keylen, digest_resume_t* carry) { // {{{
+
+	CACHED_STATE(st);
+
+	devino_t devino;
+	file_t* file = NULL;
+	cluster_t* cluster = NULL;
+
+	devino_init(&devino, fi->dev, fi->ino);
+
+	/* Check: Already have a file with the same key? */
+	if (key2cluster_find(&st->clustersByKey, (long*)key, keylen, &cluster) == HTABLE_FOUND) {
+		debug("\tFile %s (%lu bytes): added to cluster (dev=%x, ino=%ld, key=%s)", filename, fi->size,
+				devino.dev, devino.inode, bin2hex(key+1, key[0]-sizeof(key[0])));
+		/* before anything else is allocated, so its space is reused */
+		key_delete(&st->mem, key);
+		key = NULL;
+
+		file = file_new(&st->mem, path, filename, fi, cluster);
+		file->resume = carry;
+		devino2file_add(&st->filesByDevIno, &devino, file);
+		cluster_add(cluster, &st->mem, file);
 
 	} else {
+		cluster = cluster_new(&st->mem);
+		file = file_new(&st->mem, path, filename, fi, cluster);
+		file->resume = carry;
+		cluster_add(cluster, &st->mem, file);
+		devino2file_add(&st->filesByDevIno, &devino, file);
+		key2cluster_add(&st->clustersByKey, key, keylen, cluster);
+		debug("\tFile %s (%lu bytes): new cluster (dev=%x, ino=%ld, key=%s)", filename, fi->size,
+				devino.dev, devino.inode, bin2hex(key+1, key[0]-sizeof(key[0])));
 
-		digest_t digest;
+	}
 
-		if (digest_file(filename, _st, &digest) < 0)
-			goto error;
+} // }}}
 
-		struct discriminant_t* _disc = current_discriminant();
+/* Adds the file to the cluster of its key, given its content digest.
+ * carry (the digest state for the next step) is owned by the new file. */
+void _process_file_end(const path_t* path, const char* filename, finfo_t* fi, digest_t* digest, digest_resume_t* carry) { // {{{
 
-		key = (long*)key_new(_disc, _st, filename, &digest, &keylen);
+	CACHED_STATE(st);
 
-		/* Check: Already have a file with the same key? */
-		if (key2cluster_find(&st->clustersByKey, (long*)key, keylen, &cluster) == HTABLE_FOUND) {
-			file = file_new(filename, _st, cluster);
-			devino2file_add(&st->filesByDevIno, xmemdup(&devino, sizeof(devino)), file);
-			clfiles_add(&cluster->files, strdup(filename), strlen(filename)+1, file);
-			debug("\tFile %s (%lu bytes): added to cluster (dev=%x, ino=%ld, key=%s)", filename, _st->st_size,
-					devino.dev, devino.inode, bin2hex(key+1, key[0]-sizeof(key[0])));
-			free(key);
-			key = NULL;
+	size_t keylen = 0;
 
-		} else {
-			cluster = cluster_new();
-			file = file_new(filename, _st, cluster);
-			file->key = key;
-			clfiles_add(&cluster->files, strdup(filename), strlen(filename)+1, file);
-			devino2file_add(&st->filesByDevIno, xmemdup(&devino, sizeof(devino)), file);
-			key2cluster_add(&st->clustersByKey, key, keylen, cluster);
-			debug("\tFile %s (%lu bytes): new cluster (dev=%x, ino=%ld, key=%s)", filename, _st->st_size,
-					devino.dev, devino.inode, bin2hex(key+1, key[0]-sizeof(key[0])));
+	jobs_lock();
+
+	/* Another worker may have added a hardlink to this file meanwhile. */
+	if (_process_hardlink(path, filename, fi)) {
+		jobs_unlock();
+		digest_resume_delete(carry);
+		return;
+	}
 
+	long* key = (long*)key_new(&st->mem, current_discriminant(), fi, filename, digest, &keylen);
+
+	_add_file(path, filename, fi, key, keylen, carry);
+
+	jobs_unlock();
+
+} // }}}
+
+/* --eval=compare: every group of identical files gets a cluster of its
+ * own, keyed by a serial number. */
+void _process_group(file_t** filev, size_t filec, void* cbdata) { // {{{
+
+	CACHED_STATE(st);
+
+	static unsigned long serial = 0;
+	size_t keylen = 0;
+	size_t i;
+
+	jobs_lock();
+
+	++serial;
+
+	for (i = 0; i < filec; ++i) {
+		char* filename = path_dup(filev[i]->path);
+
+		if (!_process_hardlink(filev[i]->path, filename, &filev[i]->fi)) {
+			long* key = (long*)key_alloc(&st->mem, current_discriminant(), &keylen);
+			key[0] = keylen;
+			key[1] = serial;
+			_add_file(filev[i]->path, filename, &filev[i]->fi, key, keylen, NULL);
 		}
+
+		free(filename);
 	}
 
-	return;
+	jobs_unlock();
 
-error:
-	if (file) {
-		file_delete(file);
-		file = NULL;
+} // }}}
+
+/* resume: digest state carried from the previous step, or NULL */
+void _process_file(const path_t* path, const char* filename, finfo_t* fi, digest_resume_t** resume) { // {{{
+
+	digest_t digest;
+	digest_resume_t* carry = resume ? *resume : NULL;
+
+	if (resume)
+		*resume = NULL;
+
+	if (!_process_file_begin(path, filename, fi)) {
+		digest_resume_delete(carry);
+		return;
 	}
+
+	/* Content digests are computed without holding the lock, so other
+	 * workers may hash their files meanwhile. */
+	if (digest_file(filename, fi, &carry, &digest) < 0)
+		return;
+
+	_process_file_end(path, filename, fi, &digest, carry);
+
+} // }}}
+
+/*****************************************************
+ *
+ * --group=radix and --spill-dir: each step writes a record per file, and
+ * the next one reads them back grouped by key (see spill.h).
+ *
+ */
+
+static spill_t* _spill = NULL;  /** records of the current step */
+
+/* Adds a record of the file to the current step.  Takes the state lock. */
+static void _spill_add(const char* filename, finfo_t* fi, uint64_t path, digest_t* digest) { // {{{
+
+	CACHED_STATE(st);
+
+	size_t keylen = 0;
+
+	jobs_lock();
+
+	if (path == (uint64_t)-1)
+		path = spill_path_add(filename);
+
+	long* key = (long*)key_new(&st->mem, current_discriminant(), fi, filename, digest, &keylen);
+
+	if (!_spill)
+		_spill = spill_new(key_size(current_discriminant()));
+
+	spill_add(_spill, fi, path, key);
+	key_delete(&st->mem, key);
+
+	jobs_unlock();
+
+} // }}}
+
+/* step 0 */
+void _spill_file(const char* filename, finfo_t* fi) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	digest_t digest;
+	digest_resume_t* carry = NULL;
+
+	if (link_type_is_symb(cfg->flags) && (filename[0] != '/'))
+		fatal("Merging via symlinks with relative paths is not an option.\n");
+
+	if (!fi->size) {
+		debug("\tFile %s empty, ignoring.", filename);
+		return;
+	}
+
+	if (digest_file(filename, fi, &carry, &digest) < 0)
+		return;
+
+	_spill_add(filename, fi, (uint64_t)-1, &digest);
+
 } // }}}
 
 void process_file(const char* s, struct stat* _st) { // {{{
@@ -136,7 +293,7 @@ void process_file(const char* s, struct stat* _st) { // {{{
 
 	if (!st) {
 		st = &__st;
-		if (lstat(s, st) < 0)
+		if (walk_stat(AT_FDCWD, s, st) < 0)
 			error("Error accessing \"%s\": %s\n", s, strerror(errno));
 	}
 
@@ -151,7 +308,78 @@ void process_file(const char* s, struct stat* _st) { // {{{
 		return;
 	}
 
-	_process_file(s, st);
+	/* files of different sizes can't be merged */
+	if (cfg->prescan && !sizefilter_dup(st->st_size)) {
+		debug("\tFile %s (%lu bytes): unique size, ignoring.", s, st->st_size);
+		return;
+	}
+
+	finfo_t fi;
+	finfo_init(&fi, st);
+
+	if (cfg->group == 'r')
+		_spill_file(s, &fi);
+	else
+		_process_file(NULL, s, &fi, NULL);
+
+} // }}}
+
+/* --prescan, first walk */
+void prescan_file(const char* s, struct stat* st) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	if (!S_ISREG(st->st_mode) || !st->st_size)
+		return;
+
+	if (cfg->minage && (time(NULL) - st->st_mtime < cfg->minage))
+		return;
+
+	sizefilter_add(st->st_size);
+
+} // }}}
+
+/*****************************************************
+ *
+ * Pipeline (--jobs > 1): the path source (walkers, or stdin) only queues
+ * the files it finds, and --jobs threads stat and classify them (step 0)
+ * meanwhile.  With --group=radix, the groups of the last step are queued
+ * to a thread that links them while the next ones are being hashed.
+ *
+ */
+
+static jobs_stage* _step0 = NULL;
+static jobs_stage* _merger = NULL;
+
+typedef struct pipeline_file {
+	struct stat st;
+	int has_st;
+	char path[];
+} pipeline_file;
+
+void step0Job(void* item, void* cbdata) {
+	pipeline_file* f = (pipeline_file*)item;
+	process_file(f->path, f->has_st ? &f->st : NULL);
+	free(f);
+}
+
+/* files found by the path source */
+void source_file(const char* s, struct stat* st) { // {{{
+
+	if (!_step0) {
+		process_file(s, st);
+		return;
+	}
+
+	size_t len = strlen(s);
+	pipeline_file* f = (pipeline_file*)malloc(sizeof(pipeline_file) + len + 1);
+
+	if (st)
+		f->st = *st;
+	f->has_st = st != NULL;
+	memcpy(f->path, s, len + 1);
+
+	jobs_stage_push(_step0, f);
 
 } // }}}
 
@@ -168,7 +396,7 @@ void run_buf(char* buf, size_t* buf_len, char delim) { // {{{
 
 		if (*end == delim) {
 			char* _t = strndup(start, end-start);
-			process_file(_t, NULL);
+			source_file(_t, NULL);
 			start = end+1;
 			free(_t);
 		}
@@ -181,138 +409,109 @@ void run_buf(char* buf, size_t* buf_len, char delim) { // {{{
 	memmove(buf, start, *buf_len);
 } // }}}
 
-void _find(const char* path) { // {{{
-
-	struct stat st;
-	if (lstat(path, &st) < 0)
-		error("Error accessing \"%s\": %s\n", path, strerror(errno));
-	
-	if (S_ISLNK(st.st_mode))
-		return;
-
-	if (S_ISREG(st.st_mode))
-		process_file(path, &st);
-
-	if (S_ISDIR(st.st_mode)) {
-
-		DIR* dh = opendir(path);
-
-		if (!dh) {
-			error("Error opening \"%s\": %s\n", path, strerror(errno));
-			return;
-		}
-
-		struct dirent* de;
-
-		int _found_dot = 0;
-		int _found_dot2 = 0;
-
-		while ((de = readdir(dh))) {
-
-			if (!_found_dot && !strcmp(de->d_name, ".")) {
-				++_found_dot;
-				continue;
-			}
-
-			if (!_found_dot2 && !strcmp(de->d_name, "..")) {
-				++_found_dot2;
-				continue;
-			}
-
-			char* full = NULL;
-			asprintf(&full, "%s/%s", path, de->d_name);
-
-			_find(full);
-
-			free(full);
-
-		}
-
-		closedir(dh);
-	}
-
-	// char/block devices and FIFOs are ignored
-} // }}}
-
 void process_path(const char* path) { // {{{
-	struct config_t* cfg = config();
-
-	debug("Processing path %s", path);
-
-	_find(path);
+	walk_add(path);
 } // }}}
 
-int showFile(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
-
-	char* filename = (char*)key;
-	assert(strlen(filename)+1 == keylen);
-
-	debug("file=%s", filename);
-	return 0;
-}
-
 void showCluster(cluster_t* cluster, long* lkey) {
 
+	size_t i;
+
 	debug("cluster[%s]: %lu %s",
 		bin2hex(lkey+1, lkey[0] - sizeof(lkey[0])),
-		(unsigned long)cluster->files.entries,
-		cluster->files.entries ? "files" : "file");
+		(unsigned long)cluster->filec,
+		cluster->filec ? "files" : "file");
 
-	htable_foreach(&cluster->files, showFile, NULL);
+	for (i = 0; i < cluster->filec; ++i) {
+		char* filename = path_dup(cluster->filev[i]->path);
+		debug("file=%s", filename);
+		free(filename);
+	}
 
 }
 
-int fileStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
+/* files (or clusters) pending (re)classification in the current step */
+typedef struct step_items {
+	void** itemv;
+	size_t itemc;
+	size_t itemv_size;
+} step_items;
+
+void step_items_add(step_items* pending, void* item) {
+
+	if (pending->itemc == pending->itemv_size) {
+		pending->itemv_size = pending->itemv_size ? pending->itemv_size * 2 : 1024;
+		pending->itemv = realloc(pending->itemv, pending->itemv_size * sizeof(pending->itemv[0]));
+	}
 
-	char* filename = (char*)key;
-	file_t* file = (file_t*)data;	
-	run_state* prev = (run_state*)cbdata;
+	pending->itemv[pending->itemc++] = item;
+}
 
-	assert(strlen(filename)+1 == keylen);
+void fileJob(void* item, void* cbdata) {
 
-	_process_file(filename, &file->st);
+	file_t* file = (file_t*)item;
 
-	return 0;
+	char* filename = path_dup(file->path);
+	_process_file(file->path, filename, &file->fi, &file->resume);
+	free(filename);
 }
 
-int fileNameClean(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
+void clusterCompareJob(void* item, void* cbdata) {
+	compare_cluster((cluster_t*)item, _process_group, NULL);
+}
 
-	char* filename = (char*)key;
-	file_t* file = (file_t*)data;	
-	run_state* prev = (run_state*)cbdata;
+void fileKey(void* item, uint64_t* dev, uint64_t* ino) {
+	file_t* file = (file_t*)item;
+	*dev = file->fi.dev;
+	*ino = file->fi.ino;
+}
 
-	assert(strlen(filename)+1 == keylen);
+char* filePath(void* item) {
+	return path_dup(((file_t*)item)->path);
+}
 
-	file_delete(file);
+void filePrefetch(void* item) {
+	file_t* file = (file_t*)item;
+	char* filename = path_dup(file->path);
+	digest_prefetch(filename, &file->fi, file->resume ? file->resume->offset : 0);
 	free(filename);
-
-	return 0;
 }
 
-int fileDevInoClean(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
+/* a cluster is where its first file is */
+void clusterKey(void* item, uint64_t* dev, uint64_t* ino) {
+	fileKey(((cluster_t*)item)->filev[0], dev, ino);
+}
 
-	devino_t* devino = (devino_t*)key;
-	file_t* found = NULL;
-	run_state* prev = (run_state*)cbdata;
+char* clusterPath(void* item) {
+	return filePath(((cluster_t*)item)->filev[0]);
+}
 
-	free(devino);
-	/* This is freed by fileNameClean above */
-	/* file_delete(found); */
+int fileUringBegin(file_t* file) {
+	char* filename = path_dup(file->path);
+	int ret = _process_file_begin(file->path, filename, &file->fi);
+	free(filename);
+	return ret;
+}
 
-	return 0;
+void fileUringDone(file_t* file, digest_t* digest, digest_resume_t* carry) {
+	char* filename = path_dup(file->path);
+	_process_file_end(file->path, filename, &file->fi, digest, carry);
+	free(filename);
 }
 
-int clusterClean(void* key, size_t keylen, cluster_t* cluster, run_state* prev) {
+/* files, clusters and keys go away with the step arena, but digest
+ * states carried to this step (by files left alone in their cluster)
+ * are malloc'd */
+int clusterResumeClean(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
 
-	long* lkey = (long*)key;
+	cluster_t* cluster = (cluster_t*)data;
+	size_t i;
 
-	assert(lkey[0] == keylen);
+	assert(((long*)key)[0] == keylen);
 	assert(cluster);
 
-	htable_foreach(&cluster->files, fileNameClean, prev);
-
-	cluster_delete(cluster);
-	key_delete(key);
+	for (i = 0; i < cluster->filec; ++i)
+		file_destroy(cluster->filev[i]);
 
 	return 0;
 }
@@ -321,7 +520,8 @@ int clusterStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdata)
 
 	long* lkey = (long*)key;
 	cluster_t* cluster = (cluster_t*)data;
-	run_state* prev = (run_state*)cbdata;
+	step_items* pending = (step_items*)cbdata;
+	size_t i;
 
 	debug("Processing cluster[%s]:", bin2hex(lkey+1, lkey[0] - sizeof(lkey[0])));
 
@@ -332,10 +532,21 @@ int clusterStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdata)
 	if (verbose() > 2)
 		showCluster(cluster, lkey);
 
-	if (cluster->files.entries > 1)
-		htable_foreach(&cluster->files, fileStep, prev);
+	if (cluster->filec > 1)
+		for (i = 0; i < cluster->filec; ++i)
+			step_items_add(pending, cluster->filev[i]);
 
-	clusterClean(key, keylen, cluster, prev);
+	return 0;
+}
+
+/* --eval=compare works on whole clusters, not on single files */
+int clusterCompareStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
+
+	cluster_t* cluster = (cluster_t*)data;
+	step_items* pending = (step_items*)cbdata;
+
+	if (cluster->filec > 1)
+		step_items_add(pending, cluster);
 
 	return 0;
 }
@@ -418,32 +629,26 @@ void maybeReport(const char* filename, size_t filename_len, int ifile) {
 
 }
 
-int fileMergeStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
-
-	char* filename = (char*)key;
-	file_t* file = (file_t*)data;	
-	int* ifile = (int*)cbdata;
+void fileMergeStep(const char* filename, const finfo_t* fi, int* ifile) {
 
 	static char* baseFile = NULL;
-	static file_t* baseFileT = NULL;
+	static finfo_t baseFi;
 
 	CACHED_CONFIG(cfg);
 	CACHED_STATE(_state);
 
-	assert(strlen(filename)+1 == keylen);
-
-	maybeReport(filename, keylen-1, *ifile);
+	maybeReport(filename, strlen(filename), *ifile);
 
 	if (!*ifile) {
-		baseFile = filename;
-		baseFileT = file;
+		free(baseFile);
+		baseFile = strdup(filename);
+		baseFi = *fi;
 		debug("Merging: base: %s\n", baseFile);
 		ifile[0]++;
-		return 0;
+		return;
 	}
 
-	if ((file->st.st_ino == baseFileT->st.st_ino) &&
-	    (file->st.st_dev == baseFileT->st.st_dev)) {
+	if ((fi->ino == baseFi.ino) && (fi->dev == baseFi.dev)) {
 		debug("\tIgnoring, same inode: %s <- %s\n", baseFile, filename);
 
 	} else if (link_type_is_symb(cfg->flags)) {
@@ -511,7 +716,6 @@ int fileMergeStep(void* key, size_t keylen, void* data, size_t dlen, void* cbdat
 	}
 
 	ifile[0]++;
-	return 0;
 }
 
 int mergeCluster(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
@@ -519,18 +723,283 @@ int mergeCluster(void* key, size_t keylen, void* data, size_t dlen, void* cbdata
 	long* lkey = (long*)key;
 	cluster_t* cluster = (cluster_t*)data;
 
-	if (cluster->files.entries > 1) {
+	if (cluster->filec > 1) {
 		int ifile = 0;
-		htable_foreach(&cluster->files, fileMergeStep, &ifile);
+		size_t i;
+		for (i = 0; i < cluster->filec; ++i) {
+			char* filename = path_dup(cluster->filev[i]->path);
+			fileMergeStep(filename, &cluster->filev[i]->fi, &ifile);
+			free(filename);
+		}
 	}
 
 	return 0;
 }
 
+/* one job per inode of a spill group */
+typedef struct spill_item {
+	char* recv;
+	size_t recc;
+	size_t recsize;
+} spill_item;
+
+/* groups of the previous step, waiting for jobs_run() */
+typedef struct spill_batch {
+	arena mem;
+	step_items pending;
+	size_t limit;
+} spill_batch;
+
+static inline int same_inode(spill_rec* a, spill_rec* b) { // {{{
+	return (a->fi.dev == b->fi.dev) && (a->fi.ino == b->fi.ino);
+} // }}}
+
+void spillJob(void* item, void* cbdata) {
+
+	spill_item* it = (spill_item*)item;
+	spill_rec* r = SPILL_REC(it->recv, it->recsize, 0);
+	char* filename = spill_path(r->path);
+	digest_t digest;
+	digest_resume_t* carry = NULL;
+	size_t i;
+
+	if (digest_file(filename, &r->fi, &carry, &digest) >= 0) {
+		for (i = 0; i < it->recc; ++i) {
+			spill_rec* ri = SPILL_REC(it->recv, it->recsize, i);
+
+			/* other links to the same inode: only the basename may differ */
+			char* name = (i && (current_discriminant()->methods & DISC_BASENAME)) ?
+				spill_path(ri->path) : NULL;
+
+			_spill_add(name ? name : filename, &ri->fi, ri->path, &digest);
+			free(name);
+		}
+	}
+
+	free(filename);
+}
+
+void spillKey(void* item, uint64_t* dev, uint64_t* ino) {
+	spill_item* it = (spill_item*)item;
+	spill_rec* r = SPILL_REC(it->recv, it->recsize, 0);
+	*dev = r->fi.dev;
+	*ino = r->fi.ino;
+}
+
+char* spillPath(void* item) {
+	spill_item* it = (spill_item*)item;
+	return spill_path(SPILL_REC(it->recv, it->recsize, 0)->path);
+}
+
+void spillPrefetch(void* item) {
+	spill_item* it = (spill_item*)item;
+	char* filename = spill_path(SPILL_REC(it->recv, it->recsize, 0)->path);
+	digest_prefetch(filename, &SPILL_REC(it->recv, it->recsize, 0)->fi, 0);
+	free(filename);
+}
+
+void spillBatchRun(spill_batch* b) {
+	iosched_order(b->pending.itemv, b->pending.itemc, spillKey, spillPath);
+	iosched_run(b->pending.itemv, b->pending.itemc, spillKey, spillPrefetch, spillJob, NULL);
+	b->pending.itemc = 0;
+	arena_destroy(&b->mem);
+}
+
+void spillGroupStep(char* recv, size_t recc, size_t recsize, void* cbdata) {
+
+	spill_batch* b = (spill_batch*)cbdata;
+	size_t start = 0;
+	size_t i;
+
+	/* records are sorted by <dev,ino>: a single inode has nothing to merge */
+	if ((recc < 2) || same_inode(SPILL_REC(recv, recsize, 0), SPILL_REC(recv, recsize, recc - 1)))
+		return;
+
+	char* copy = (char*)arena_alloc(&b->mem, recc * recsize);
+	memcpy(copy, recv, recc * recsize);
+
+	for (i = 1; i <= recc; ++i) {
+		if ((i < recc) && same_inode(SPILL_REC(copy, recsize, start), SPILL_REC(copy, recsize, i)))
+			continue;
+
+		spill_item* it = (spill_item*)arena_alloc(&b->mem, sizeof(spill_item));
+		it->recv = copy + start * recsize;
+		it->recc = i - start;
+		it->recsize = recsize;
+		step_items_add(&b->pending, it);
+		start = i;
+	}
+
+	if (b->mem.used > b->limit)
+		spillBatchRun(b);
+}
+
+void mergeRecords(char* recv, size_t recc, size_t recsize) {
+
+	int ifile = 0;
+	size_t i;
+
+	for (i = 0; i < recc; ++i) {
+		spill_rec* r = SPILL_REC(recv, recsize, i);
+		char* filename = spill_path(r->path);
+		fileMergeStep(filename, &r->fi, &ifile);
+		free(filename);
+	}
+}
+
+/* a group for the merging stage */
+typedef struct merge_group {
+	size_t recc;
+	size_t recsize;
+	char recv[];
+} merge_group;
+
+void mergeJob(void* item, void* cbdata) {
+	merge_group* g = (merge_group*)item;
+	mergeRecords(g->recv, g->recc, g->recsize);
+	free(g);
+}
+
+void spillMergeGroup(char* recv, size_t recc, size_t recsize, void* cbdata) {
+
+	if (recc < 2)
+		return;
+
+	if (!_merger) {
+		mergeRecords(recv, recc, recsize);
+		return;
+	}
+
+	merge_group* g = (merge_group*)malloc(sizeof(merge_group) + recc * recsize);
+	g->recc = recc;
+	g->recsize = recsize;
+	memcpy(g->recv, recv, recc * recsize);
+
+	jobs_stage_push(_merger, g);
+}
+
+/* Runs the steps after the current one on the records of from, and
+ * merges the groups of the last one. */
+void spill_steps(spill_t* from) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	run_state prev;
+
+	_spill = from;
+
+	while (_spill && state_next_step(&prev)) {
+
+		spill_t* from = _spill;
+		spill_batch batch;
+
+		_spill = spill_new(key_size(current_discriminant()));
+
+		arena_init(&batch.mem, 0);
+		memset(&batch.pending, 0, sizeof(batch.pending));
+		batch.limit = (cfg->max_memory ? cfg->max_memory : SPILL_DEFAULT_MEMORY) / 2;
+
+		spill_groups(from, spillGroupStep, &batch);
+		spillBatchRun(&batch);
+		free(batch.pending.itemv);
+
+		htable_destroy(&prev.filesByDevIno);
+		htable_destroy(&prev.clustersByKey);
+		arena_destroy(&prev.mem);
+	}
+
+	if (_spill)
+		spill_groups(_spill, spillMergeGroup, NULL);
+	_spill = NULL;
+
+} // }}}
+
+/* --stream: step 0 groups waiting to go through the other steps */
+typedef struct stream_batch {
+	spill_t* recs;
+	size_t recc;
+} stream_batch;
+
+void streamFlush(stream_batch* b) {
+
+	if (!b->recs)
+		return;
+
+	debug("stream: %lu files.", (unsigned long)b->recc);
+
+	spill_steps(b->recs);
+	state_rewind();
+
+	b->recs = NULL;
+	b->recc = 0;
+}
+
+void streamGroup(char* recv, size_t recc, size_t recsize, void* cbdata) {
+
+	CACHED_CONFIG(cfg);
+
+	stream_batch* b = (stream_batch*)cbdata;
+	size_t i;
+
+	if ((recc < 2) || same_inode(SPILL_REC(recv, recsize, 0), SPILL_REC(recv, recsize, recc - 1)))
+		return;
+
+	if (!b->recs)
+		b->recs = spill_new(key_size(current_discriminant()));
+
+	for (i = 0; i < recc; ++i) {
+		spill_rec* r = SPILL_REC(recv, recsize, i);
+		spill_add(b->recs, &r->fi, r->path, r->key);
+	}
+
+	/* whole groups only, so a batch may go over */
+	b->recc += recc;
+	if (b->recc >= cfg->stream)
+		streamFlush(b);
+}
+
+/* the steps after the walk, with --group=radix */
+void run_spill() { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	spill_path_sync();
+
+	/* links are made by a single thread, one group after the other */
+	if (cfg->jobs > 1)
+		_merger = jobs_stage_new(1, PIPELINE_QUEUE_SIZE, mergeJob, NULL);
+
+	if (!cfg->stream) {
+		spill_steps(_spill);
+
+	} else {
+		/* step 0 groups are final once sorted: each batch of them is
+		 * carried through the other steps and merged before the next
+		 * one is taken */
+		stream_batch batch = { NULL, 0 };
+
+		if (_spill) {
+			spill_t* from = _spill;
+			_spill = NULL;
+			spill_groups(from, streamGroup, &batch);
+		}
+
+		streamFlush(&batch);
+	}
+
+	if (_merger)
+		jobs_stage_finish(_merger);
+	_merger = NULL;
+
+} // }}}
+
 void run() { // {{{
 	
 	struct config_t* cfg = config();
 
+	if (cfg->jobs > 1)
+		_step0 = jobs_stage_new(cfg->jobs, PIPELINE_QUEUE_SIZE, step0Job, NULL);
+
 	if (path_source_is_stdin(cfg->flags)) {
 
 		char delim = path_source_is_stdin0(cfg->flags) ? '\0' : '\n'; // nul terminated
@@ -557,10 +1026,34 @@ void run() { // {{{
 
 	} else {
 
+		if (cfg->prescan) {
+			sizefilter_init(cfg->prescan);
+			foreach_path(process_path);
+			walk_run(prescan_file);
+		}
+
 		foreach_path(process_path);
 
+		walk_run(source_file);
+
+	}
+
+	if (_step0)
+		jobs_stage_finish(_step0);
+	_step0 = NULL;
+
+	if (cfg->prescan)
+		sizefilter_destroy();
+
+	if (cfg->group == 'r') {
+		run_spill();
+		return;
 	}
 
+	/* Each step waits for the previous one: a cluster may gather files
+	 * of several clusters of the previous step, so none is complete
+	 * before all of them are hashed.  Only --group=radix, whose groups
+	 * come out of a sort, hands them to a merging stage early. */
 	run_state prev;
 
 	while (1) {
@@ -568,15 +1061,43 @@ void run() { // {{{
 		if (!state_next_step(&prev))
 			break;
 
-		htable_foreach(&prev.clustersByKey, clusterStep, &prev);
+		step_items pending = { NULL, 0, 0 };
 
-		htable_foreach(&prev.filesByDevIno, fileDevInoClean, &prev);
+		if (current_discriminant()->methods & DISC_COMPARE) {
+			/* whole clusters are compared, --jobs at a time */
+			htable_foreach(&prev.clustersByKey, clusterCompareStep, &pending);
+			iosched_order(pending.itemv, pending.itemc, clusterKey, clusterPath);
+			iosched_run(pending.itemv, pending.itemc, clusterKey, NULL, clusterCompareJob, NULL);
+
+		} else {
+			htable_foreach(&prev.clustersByKey, clusterStep, &pending);
+			iosched_order(pending.itemv, pending.itemc, fileKey, filePath);
+
+			/* files of the previous step are hashed concurrently (--jobs,
+			 * --io-depth per device), or kept in flight by a single
+			 * thread (--read=uring) */
+			if ((cfg->read_policy == 'u') && digest_uring_available())
+				digest_files_uring((file_t**)pending.itemv, pending.itemc, fileUringBegin, fileUringDone);
+			else
+				iosched_run(pending.itemv, pending.itemc, fileKey, filePrefetch, fileJob, NULL);
+		}
+
+		free(pending.itemv);
+
+		if (cfg->discriminantv[prev.idiscriminant].carry)
+			htable_foreach(&prev.clustersByKey, clusterResumeClean, &prev);
 
 		htable_destroy(&prev.filesByDevIno);
 		htable_destroy(&prev.clustersByKey);
+		arena_destroy(&prev.mem);
 
 	}
 
+	size_t pathc, dirc, pathbytes;
+	path_store_stats(&pathc, &dirc, &pathbytes);
+	debug("Path store: %lu files, %lu directories, %lu bytes.",
+			(unsigned long)pathc, (unsigned long)dirc, (unsigned long)pathbytes);
+
 	htable_foreach(&state()->clustersByKey, mergeCluster, NULL);
 
 } // }}}
@@ -621,6 +1142,12 @@ void setup() { // {{{
 		cgroup_init(cfg->cgroups[icg++]);
 
 	state_setup();
+
+	if (cfg->catalog)
+		catalog_open(cfg->catalog);
+
+	if (cfg->group == 'r')
+		spill_setup(cfg->spill_dir, cfg->max_memory);
 } // }}}
 
 int main(int argc, char* argv[]) { // {{{
@@ -631,6 +1158,8 @@ int main(int argc, char* argv[]) { // {{{
 
 	run();
 
+	catalog_close();
+
 	digest_clean();
 
 	fprintf(stdout, "saved=%llu\n", (unsigned long long)state()->saved);
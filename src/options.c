@@ -100,9 +100,65 @@ unsigned long parse_age(const char* value) { // {{{
 
 } // }}}
 
-void parse_read(const char* s, char* read_policy, unsigned* bufsize) { // {{{
+size_t parse_size(const char* value) { // {{{
 
-	char _policy[5];
+	unsigned long size = 0;
+	char unit = 0;
+
+	if (sscanf(value, "%lu%c", &size, &unit) < 1)
+		fatal("Invalid size \"%s\".\n", value);
+
+	switch (unit) {
+		case '\0':
+			break;
+
+		case 'k':
+		case 'K':
+			size <<= 10;
+			break;
+
+		case 'm':
+		case 'M':
+			size <<= 20;
+			break;
+
+		case 'g':
+		case 'G':
+			size <<= 30;
+			break;
+
+		default:
+			fatal("Invalid size unit '%c'.\n", unit);
+	}
+
+	return size;
+
+} // }}}
+
+void parse_mmap_advice(const char* s, int* advice) { // {{{
+
+	char* _t = strdup(s);
+	char* _adv = NULL;
+
+	while ((_adv = strtok(_adv ? NULL : _t, ","))) {
+		if (!strcmp(_adv, "hugepage"))
+			*advice |= MMAP_ADVICE_HUGEPAGE;
+
+		else if (!strcmp(_adv, "populate"))
+			*advice |= MMAP_ADVICE_POPULATE;
+
+		else
+			fatal("Unknown mmap advice \"%s\".\n", _adv);
+	}
+
+	free(_t);
+
+} // }}}
+
+void parse_read(const char* s, struct config_t* cfg) { // {{{
+
+	char _policy[7];
+	unsigned _arg = 0;
 	long page_size = sysconf(
 #if defined(_SC_PAGESIZE)
 		_SC_PAGESIZE
@@ -116,20 +172,61 @@ void parse_read(const char* s, char* read_policy, unsigned* bufsize) { // {{{
 #endif
 	);
 
-	if (sscanf(s, "%4[readmp],%u", &_policy[0], bufsize) < 1)
+	int _extra = 0;
+	int nfields = sscanf(s, "%6[readmpuingct],%u,%n", &_policy[0], &_arg, &_extra);
+	if (nfields < 1)
 		fatal("Unknown read policy spec.\n");
 
-	if (!strcmp(_policy, "read"))
-		*read_policy = 'r';
+	if (!strcmp(_policy, "uring")) {
+		cfg->read_policy = 'u';
+		if (nfields > 1) {
+			if (!_arg || (_arg > 4096))
+				fatal("Invalid io_uring depth (must be between 1 and 4096).\n");
+			cfg->uring_depth = _arg;
+		}
+		return;
+	}
+
+	if (nfields > 1) {
+		if (!_arg)
+			fatal("Invalid buffer size.\n");
+		cfg->bufsize = _arg;
+	}
+
+	if (!strcmp(_policy, "read")) {
+		cfg->read_policy = 'r';
+
+		/* read,size,dontneed */
+		if (_extra) {
+			if (strcmp(s + _extra, "dontneed"))
+				fatal("Unknown read advice \"%s\".\n", s + _extra);
+			cfg->flags |= CONFIG_READ_DONTNEED;
+		}
+	}
+
+	else if (!strcmp(_policy, "direct")) {
+		cfg->read_policy = 'd';
+		if (cfg->bufsize % DIRECT_ALIGN) {
+			cfg->bufsize = ((cfg->bufsize / DIRECT_ALIGN) + 1) * DIRECT_ALIGN;
+			warning("Adjusting buffer size to %u (require multiple of %u).\n", cfg->bufsize, DIRECT_ALIGN);
+		}
+	}
 
-	if (!strcmp(_policy, "mmap")) {
-		*read_policy = 'm';
-		if (*bufsize % page_size) {
-			*bufsize = ((*bufsize / page_size) + 1 ) * page_size;
-			warning("Adjusting buffer size to %u (require multiple of %u).\n", *bufsize, page_size); 
+	else if (!strcmp(_policy, "mmap")) {
+		cfg->read_policy = 'm';
+		if (cfg->bufsize % page_size) {
+			cfg->bufsize = ((cfg->bufsize / page_size) + 1 ) * page_size;
+			warning("Adjusting buffer size to %u (require multiple of %u).\n", cfg->bufsize, page_size); 
 		}
+
+		/* mmap,size,advice[,advice] */
+		if (_extra)
+			parse_mmap_advice(s + _extra, &cfg->mmap_advice);
 	}
 
+	else
+		fatal("Unknown read policy \"%s\".\n", _policy);
+
 
 } // }}}
 
@@ -159,12 +256,23 @@ void parse_options(int argc, char* argv[]) { // {{{
 			{"cgroup",          required_argument, 0, 'c' },
 			{"verbose",         no_argument,       0, 'v' },
 			{"jobs",            required_argument, 0, 'j' },
+			{"walkers",         required_argument, 0, 'W' },
+			{"io-depth",        required_argument, 0, 'Q' },
+			{"order",           required_argument, 0, 'F' },
+			{"prefetch",        required_argument, 0, 'A' },
+			{"stat-dont-sync",  no_argument,       0, 'S' },
 			{"read",            required_argument, 0, 'R' },
+			{"catalog",         required_argument, 0, 'C' },
+			{"prescan",         optional_argument, 0, 'P' },
+			{"group",           required_argument, 0, 'G' },
+			{"stream",          optional_argument, 0, 's' },
+			{"spill-dir",       required_argument, 0, 'D' },
+			{"max-memory",      required_argument, 0, 'M' },
 			{"help",            no_argument,       0, '?' },
 			{0,                 0,                 0,  0  }
 		};
 
-		c = getopt_long(argc, argv, "0m:e:HLO:o:nN:i:c:t:vj:R:h",
+		c = getopt_long(argc, argv, "0m:e:HLO:o:nN:i:c:t:vj:W:Q:F:A:SR:C:P::G:s::D:M:h",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -230,8 +338,87 @@ void parse_options(int argc, char* argv[]) { // {{{
 				cfg->verbose++;
 				break;
 
+			case 'j':
+				cfg->jobs = parse_int(optarg, -1, -1);
+				if ((cfg->jobs < 1) || (cfg->jobs > MAX_JOBS))
+					fatal("Invalid jobs count (must be between 1 and %d).\n", MAX_JOBS);
+				break;
+
+			case 'W':
+				cfg->walkers = parse_int(optarg, -1, -1);
+				if ((cfg->walkers < 1) || (cfg->walkers > MAX_JOBS))
+					fatal("Invalid walkers count (must be between 1 and %d).\n", MAX_JOBS);
+				break;
+
+			case 'Q': {
+				unsigned rot = 0;
+				unsigned ssd = cfg->io_depth_ssd;
+				int nfields = sscanf(optarg, "%u,%u", &rot, &ssd);
+				if ((nfields < 1) || !rot || !ssd || (rot > MAX_JOBS) || (ssd > MAX_JOBS))
+					fatal("Invalid I/O depth (must be between 1 and %d).\n", MAX_JOBS);
+				cfg->io_depth_rot = rot;
+				cfg->io_depth_ssd = ssd;
+				break;
+			}
+
+			case 'F':
+				if (!strcmp(optarg, "none"))
+					cfg->order = 'n';
+				else if (!strcmp(optarg, "inode"))
+					cfg->order = 'i';
+				else if (!strcmp(optarg, "fiemap"))
+					cfg->order = 'f';
+				else
+					fatal("Unknown read order \"%s\".\n", optarg);
+				break;
+
+			case 'A':
+				cfg->prefetch = parse_int(optarg, -1, -1);
+				if (cfg->prefetch > MAX_PREFETCH)
+					fatal("Invalid prefetch count (must be between 0 and %d).\n", MAX_PREFETCH);
+				break;
+
+			case 'S':
+				cfg->flags |= CONFIG_STAT_DONT_SYNC;
+				break;
+
 			case 'R':
-				parse_read(optarg, &cfg->read_policy, &cfg->bufsize);
+				parse_read(optarg, cfg);
+				break;
+
+			case 'C':
+				cfg->catalog = strdup(optarg);
+				break;
+
+			case 'P':
+				cfg->prescan = optarg ? parse_size(optarg) : PRESCAN_DEFAULT_SIZE;
+				if (cfg->prescan < 1024)
+					fatal("Invalid prescan size (must be at least 1k).\n");
+				break;
+
+			case 'G':
+				if (!strcmp(optarg, "hash"))
+					cfg->group = 'h';
+				else if (!strcmp(optarg, "radix"))
+					cfg->group = 'r';
+				else
+					fatal("Unknown grouping engine \"%s\".\n", optarg);
+				break;
+
+			case 's':
+				cfg->stream = optarg ? parse_size(optarg) : STREAM_DEFAULT_BATCH;
+				if (!cfg->stream)
+					fatal("Invalid stream batch (must be at least 1 file).\n");
+				break;
+
+			case 'D':
+				cfg->spill_dir = strdup(optarg);
+				break;
+
+			case 'M':
+				cfg->max_memory = parse_size(optarg);
+				if (cfg->max_memory < 1024*1024)
+					fatal("Invalid max memory (must be at least 1M).\n");
 				break;
 
 			case '?':
@@ -246,6 +433,29 @@ void parse_options(int argc, char* argv[]) { // {{{
 
 	discriminantv_post_parse(cfg->discriminantv, cfg->discriminantc);
 
+	if (cfg->max_memory && !cfg->spill_dir)
+		cfg->spill_dir = strdup(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+	if (cfg->stream)
+		cfg->group = 'r';
+
+	if (cfg->spill_dir) {
+		cfg->group = 'r';
+		if (!cfg->max_memory)
+			cfg->max_memory = SPILL_DEFAULT_MEMORY;
+	}
+
+	if (cfg->group == 'r') {
+		int i;
+
+		/* records don't keep digest states */
+		for (i = 0; i < cfg->discriminantc; ++i) {
+			if (cfg->discriminantv[i].methods & DISC_COMPARE)
+				fatal("--eval=compare can't be used with --group=radix or --spill-dir.\n");
+			cfg->discriminantv[i].carry = 0;
+		}
+	}
+
 	if (cfg->report_file) {
 		if (!strcmp(cfg->report_file, "-"))
 			cfg->report_fd = 0;
@@ -267,5 +477,9 @@ void parse_options(int argc, char* argv[]) { // {{{
 		path_source_set(&cfg->flags, PATHSOURCE_STDIN);
 
 	}
+
+	/* stdin can't be read twice */
+	if (cfg->prescan && path_source_is_stdin(cfg->flags))
+		fatal("--prescan needs the paths as arguments.\n");
 } // }}}
 
@@ -0,0 +1,163 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "pathstore.h"
+#include "arena.h"
+#include "htable.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* name holds the component with its leading '/' (but for the first one):
+ * the full path is the names from the root down, one after the other */
+struct path_t { // {{{
+	const path_t* parent;
+	uint32_t len;
+	char name[];
+}; // }}}
+
+static struct {
+	arena mem;          /** nodes                              */
+	htable dirs;        /** directories, by <parent, name>     */
+	size_t pathc;
+
+	/* last directory interned: most files come right after a sibling */
+	char* last;
+	size_t last_len;
+	size_t last_size;
+	const path_t* last_dir;
+} _ps;
+
+/* length of the directory part of path[0, len) */
+static size_t path_dirlen(const char* path, size_t len) { // {{{
+	while (len && (path[len-1] != '/'))
+		--len;
+	return len ? len - 1 : 0;
+} // }}}
+
+static int path_eq(const void* a, const void* b, size_t len) { // {{{
+	const path_t* pa = (const path_t*)a;
+	const path_t* pb = (const path_t*)b;
+	return (pa->parent == pb->parent) && !memcmp(pa->name, pb->name, len);
+} // }}}
+
+static inline uint64_t path_hash(const path_t* p) { // {{{
+	return htable_hash(p->name, p->len) ^ htable_hash64((uintptr_t)p->parent);
+} // }}}
+
+static path_t* path_node(const path_t* parent, const char* name, size_t len) { // {{{
+
+	path_t* p = (path_t*)arena_alloc(&_ps.mem, sizeof(path_t) + len);
+
+	p->parent = parent;
+	p->len = len;
+	memcpy(p->name, name, len);
+
+	return p;
+} // }}}
+
+/* the directory path[0, len), interned */
+static const path_t* path_dir(const char* path, size_t len) { // {{{
+
+	if (!len)
+		return NULL;
+
+	size_t dlen = path_dirlen(path, len);
+	const path_t* parent = path_dir(path, dlen);
+
+	path_t* p = path_node(parent, path + dlen, len - dlen);
+	uint64_t hash = path_hash(p);
+	void* found = NULL;
+	size_t dummy;
+
+	if (htable_find_h(&_ps.dirs, p, p->len, hash, &found, &dummy) == HTABLE_FOUND) {
+		arena_release(&_ps.mem, p);
+		return (const path_t*)found;
+	}
+
+	htable_add_h(&_ps.dirs, p, p->len, p, sizeof(*p), hash);
+
+	return p;
+} // }}}
+
+const path_t* path_intern(const char* path) { // {{{
+
+	if (!_ps.mem.chunk_size) {
+		arena_init(&_ps.mem, 0);
+		htable_init_typed(&_ps.dirs, 0, 0, path_eq);
+	}
+
+	size_t len = strlen(path);
+	size_t dlen = path_dirlen(path, len);
+	const path_t* dir = NULL;
+
+	if ((dlen == _ps.last_len) && _ps.last && !memcmp(path, _ps.last, dlen)) {
+		dir = _ps.last_dir;
+
+	} else {
+		dir = path_dir(path, dlen);
+
+		if (dlen + 1 > _ps.last_size) {
+			_ps.last_size = 2 * (dlen + 1);
+			_ps.last = (char*)realloc(_ps.last, _ps.last_size);
+		}
+		memcpy(_ps.last, path, dlen);
+		_ps.last_len = dlen;
+		_ps.last_dir = dir;
+	}
+
+	++_ps.pathc;
+
+	return path_node(dir, path + dlen, len - dlen);
+} // }}}
+
+size_t path_len(const path_t* p) { // {{{
+
+	size_t len = 0;
+
+	for (; p; p = p->parent)
+		len += p->len;
+
+	return len;
+} // }}}
+
+char* path_str(const path_t* p, char* buf) { // {{{
+
+	char* end = buf + path_len(p);
+
+	*end = '\0';
+
+	for (; p; p = p->parent) {
+		end -= p->len;
+		memcpy(end, p->name, p->len);
+	}
+
+	return buf;
+} // }}}
+
+char* path_dup(const path_t* p) { // {{{
+	return path_str(p, (char*)malloc(path_len(p) + 1));
+} // }}}
+
+void path_store_stats(size_t* pathc, size_t* dirc, size_t* bytes) { // {{{
+	*pathc = _ps.pathc;
+	*dirc = _ps.dirs.entries;
+	*bytes = _ps.mem.used;
+} // }}}
@@ -0,0 +1,48 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_PATHSTORE_H
+#define __FILEDEDUP_PATHSTORE_H
+
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * Path store: every path seen is kept once for the whole run, as its
+ * last component and a link to its (interned) directory, so files of
+ * the same directory share its prefix.  Full paths are only rebuilt
+ * when a file is opened, linked or reported.
+ *
+ * path_intern() must be called with the state lock held; the other
+ * functions may be called from any thread.
+ *
+ */
+
+typedef struct path_t path_t;
+
+const path_t* path_intern(const char* path);
+
+size_t path_len(const path_t* p);             /** strlen() of the full path */
+char* path_str(const path_t* p, char* buf);   /** buf: path_len(p) + 1 bytes */
+char* path_dup(const path_t* p);              /** malloc'd full path */
+
+void path_store_stats(size_t* pathc, size_t* dirc, size_t* bytes);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "queue.h"
+
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+queue_t* queue_init(queue_t* q, size_t size) { // {{{
+
+	size_t n = 2;
+	size_t i;
+
+	while (n < size)
+		n *= 2;
+
+	q->cellv = (queue_cell*)malloc(n * sizeof(q->cellv[0]));
+	q->mask = n - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->closed = 0;
+	q->event = 0;
+	q->waiters = 0;
+
+	for (i = 0; i < n; ++i)
+		q->cellv[i].seq = i;
+
+	return q;
+} // }}}
+
+void queue_destroy(queue_t* q) { // {{{
+	free(q->cellv);
+	q->cellv = NULL;
+} // }}}
+
+int queue_trypush(queue_t* q, void* item) { // {{{
+
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	queue_cell* c;
+
+	while (1) {
+		c = &q->cellv[pos & q->mask];
+
+		size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+
+		} else if (diff < 0) {
+			/* not popped yet since the last lap */
+			return 0;
+
+		} else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+
+	c->item = item;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+} // }}}
+
+int queue_trypop(queue_t* q, void** item) { // {{{
+
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	queue_cell* c;
+
+	while (1) {
+		c = &q->cellv[pos & q->mask];
+
+		size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+
+		} else if (diff < 0) {
+			/* not pushed yet */
+			return 0;
+
+		} else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+
+	*item = c->item;
+	__atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+} // }}}
+
+/* wakes the threads blocked in queue_wait(), after a push, pop or close */
+static void queue_wake(queue_t* q) { // {{{
+
+	/* pairs with the one in queue_wait(): either the waiter sees the
+	 * change, or this sees the waiter */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&q->waiters, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&q->event, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &q->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+} // }}}
+
+/* Spins a little, then yields, then blocks until the next wake up.
+ * Returns what done() returns: non zero once it holds. */
+static int queue_wait(queue_t* q, unsigned* round, int (*done)(queue_t*, void**), void** item) { // {{{
+
+	if (*round < 64) {
+		/* spin */
+
+	} else if (*round < 128) {
+		sched_yield();
+
+	} else {
+		__atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		unsigned event = __atomic_load_n(&q->event, __ATOMIC_SEQ_CST);
+		int ret = done(q, item);
+
+		if (!ret)
+			syscall(SYS_futex, &q->event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+
+		__atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (ret)
+			return ret;
+	}
+
+	++*round;
+
+	return done(q, item);
+} // }}}
+
+static int queue_push_done(queue_t* q, void** item) { // {{{
+	return queue_trypush(q, *item);
+} // }}}
+
+/* 1: popped, -1: closed and empty */
+static int queue_pop_done(queue_t* q, void** item) { // {{{
+
+	if (queue_trypop(q, item))
+		return 1;
+
+	/* the last pushes happened before closing */
+	if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+		return queue_trypop(q, item) ? 1 : -1;
+
+	return 0;
+} // }}}
+
+void queue_push(queue_t* q, void* item) { // {{{
+
+	unsigned round = 0;
+
+	while (!queue_wait(q, &round, queue_push_done, &item))
+		;
+
+	queue_wake(q);
+} // }}}
+
+int queue_pop(queue_t* q, void** item) { // {{{
+
+	unsigned round = 0;
+	int ret;
+
+	while (!(ret = queue_wait(q, &round, queue_pop_done, item)))
+		;
+
+	if (ret < 0)
+		return 0;
+
+	queue_wake(q);
+
+	return 1;
+} // }}}
+
+void queue_close(queue_t* q) { // {{{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+	queue_wake(q);
+} // }}}
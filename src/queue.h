@@ -0,0 +1,68 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_QUEUE_H
+#define __FILEDEDUP_QUEUE_H
+
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * Bounded lock-free MPMC queue
+ *
+ * A ring of cells, each tagged with a sequence number that tells
+ * producers and consumers whose turn it is (Vyukov's scheme): pushing or
+ * popping is a compare-and-swap on the head or tail, and no thread ever
+ * waits on a lock held by another one.
+ *
+ * queue_push() waits while the queue is full, which is what holds back
+ * a stage that runs ahead of the next one; queue_pop() waits while it is
+ * empty, and returns 0 once it is also closed.  Waiting threads spin,
+ * then yield, then sleep on a futex that pushes, pops and closes wake.
+ *
+ */
+
+typedef struct queue_cell {
+	size_t seq;
+	void* item;
+} queue_cell;
+
+typedef struct queue_t {
+	queue_cell* cellv;
+	size_t mask;
+
+	/* on cache lines of their own: producers and consumers don't share */
+	size_t head __attribute__((aligned(64)));   /** next push */
+	size_t tail __attribute__((aligned(64)));   /** next pop  */
+	int closed __attribute__((aligned(64)));
+	unsigned event;    /** futex word, bumped by wake ups */
+	int waiters;       /** threads sleeping, or about to, on event */
+} queue_t;
+
+queue_t* queue_init(queue_t* q, size_t size);   /** size: rounded up to a power of 2 */
+void queue_destroy(queue_t* q);
+
+int queue_trypush(queue_t* q, void* item);      /** 0 if full  */
+int queue_trypop(queue_t* q, void** item);      /** 0 if empty */
+
+void queue_push(queue_t* q, void* item);
+int queue_pop(queue_t* q, void** item);
+void queue_close(queue_t* q);                   /** no more pushes */
+
+#endif
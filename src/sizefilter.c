@@ -0,0 +1,80 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "sizefilter.h"
+#include "htable.h"
+
+#include <stdint.h>
+
+/* Both bits of a size are in the same word (a "blocked" Bloom filter),
+ * so they are set at once, and two threads adding the same size can't
+ * both miss that it was seen. */
+
+static struct {
+	uint64_t* seen;
+	uint64_t* dup;
+	uint64_t mask;       /** words per bitmap, minus 1 */
+} _sf;
+
+void sizefilter_init(size_t bytes) { // {{{
+
+	uint64_t words = 1;
+
+	/* a power of 2, up to half of bytes for each bitmap */
+	while (words * 2 * sizeof(uint64_t) <= bytes / 2)
+		words *= 2;
+
+	_sf.seen = (uint64_t*)calloc(words, sizeof(uint64_t));
+	_sf.dup = (uint64_t*)calloc(words, sizeof(uint64_t));
+	_sf.mask = words - 1;
+
+} // }}}
+
+void sizefilter_destroy() { // {{{
+	free(_sf.seen);
+	free(_sf.dup);
+	_sf.seen = _sf.dup = NULL;
+} // }}}
+
+static inline uint64_t* sizefilter_word(uint64_t* bitmap, off_t size, uint64_t* bits) { // {{{
+	uint64_t h = htable_hash64((uint64_t)size);
+	*bits = (1ULL << (h >> 58)) | (1ULL << ((h >> 52) & 63));
+	return &bitmap[h & _sf.mask];
+} // }}}
+
+void sizefilter_add(off_t size) { // {{{
+
+	uint64_t bits;
+	uint64_t* w = sizefilter_word(_sf.seen, size, &bits);
+
+	if ((__atomic_fetch_or(w, bits, __ATOMIC_RELAXED) & bits) == bits) {
+		w = sizefilter_word(_sf.dup, size, &bits);
+		__atomic_fetch_or(w, bits, __ATOMIC_RELAXED);
+	}
+
+} // }}}
+
+int sizefilter_dup(off_t size) { // {{{
+
+	uint64_t bits;
+	uint64_t* w = sizefilter_word(_sf.dup, size, &bits);
+
+	return (*w & bits) == bits;
+} // }}}
@@ -0,0 +1,46 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_SIZEFILTER_H
+#define __FILEDEDUP_SIZEFILTER_H
+
+#include <sys/types.h>
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * --prescan: file sizes seen by a first walk of the tree, so the second
+ * one only keeps files whose size was seen more than once.
+ *
+ * Two bitmaps, "seen" and "seen twice", in the style of a Bloom filter:
+ * a size may be taken for a repeated one when it was not (the file is
+ * just kept), never the other way around.
+ *
+ * sizefilter_add() may be called from several threads at once.
+ *
+ */
+
+void sizefilter_init(size_t bytes);     /** memory for both bitmaps */
+void sizefilter_destroy();
+
+void sizefilter_add(off_t size);
+int sizefilter_dup(off_t size);          /** 0 if size was seen at most once */
+
+#endif
@@ -0,0 +1,676 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define _GNU_SOURCE
+
+#include "spill.h"
+#include "pathstore.h"
+#include "jobs.h"
+#include "config.h"
+#include "error.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define SPILL_FANIN      64             /** runs merged at once            */
+#define SPILL_IO_SIZE    (1024*1024)    /** buffer of each run being merged */
+#define SPILL_MIN_RECS   1024
+#define RADIX_CUTOFF     32             /** smaller buckets go to qsort_r() */
+#define RADIX_PARALLEL   (64*1024)      /** records before buckets are sorted by jobs */
+
+typedef struct spill_run { // {{{
+	int fd;
+	uint64_t recc;
+} spill_run; // }}}
+
+struct spill_t { // {{{
+	size_t keylen;
+	size_t recsize;
+
+	char* buf;          /** records not written yet */
+	size_t bufc;
+	size_t buf_size;
+
+	spill_run* runv;    /** sorted runs */
+	size_t runc;
+}; // }}}
+
+static struct {
+	char* dir;
+	size_t max_memory;
+
+	int path_fd;
+	char* path_buf;
+	size_t path_bufc;
+	uint64_t path_off;  /** bytes already in the path file */
+} _sp = { NULL, 0, -1, NULL, 0, 0 };
+
+static int spill_tmpfile() { // {{{
+
+	char* name = NULL;
+	asprintf(&name, "%s/filededup.XXXXXX", _sp.dir);
+
+	int fd = mkstemp(name);
+	if (fd < 0)
+		fatal("Could not create a file in spill directory \"%s\": %s.\n", _sp.dir, strerror(errno));
+
+	unlink(name);
+	free(name);
+
+	return fd;
+} // }}}
+
+static void write_all(int fd, const char* buf, size_t len) { // {{{
+
+	while (len) {
+		ssize_t nwritten = write(fd, buf, len);
+
+		if (nwritten < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("Could not write to spill directory \"%s\": %s.\n", _sp.dir, strerror(errno));
+		}
+
+		buf += nwritten;
+		len -= nwritten;
+	}
+} // }}}
+
+void spill_setup(const char* dir, size_t max_memory) { // {{{
+
+	if (!dir)
+		return;
+
+	_sp.dir = strdup(dir);
+	_sp.max_memory = max_memory;
+	_sp.path_fd = spill_tmpfile();
+	_sp.path_buf = (char*)malloc(SPILL_IO_SIZE);
+} // }}}
+
+/*****************************************************
+ *
+ * Path file (or the path store, without a spill directory)
+ *
+ */
+
+void spill_path_sync() { // {{{
+	if (!_sp.dir)
+		return;
+
+	write_all(_sp.path_fd, _sp.path_buf, _sp.path_bufc);
+	_sp.path_off += _sp.path_bufc;
+	_sp.path_bufc = 0;
+} // }}}
+
+uint64_t spill_path_add(const char* path) { // {{{
+
+	if (!_sp.dir)
+		return (uint64_t)(uintptr_t)path_intern(path);
+
+	size_t len = strlen(path) + 1;
+	uint64_t ret = _sp.path_off + _sp.path_bufc;
+
+	if (_sp.path_bufc + len > SPILL_IO_SIZE)
+		spill_path_sync();
+
+	if (len > SPILL_IO_SIZE) {
+		write_all(_sp.path_fd, path, len);
+		_sp.path_off += len;
+		return ret;
+	}
+
+	memcpy(_sp.path_buf + _sp.path_bufc, path, len);
+	_sp.path_bufc += len;
+
+	return ret;
+} // }}}
+
+char* spill_path(uint64_t offset) { // {{{
+
+	if (!_sp.dir)
+		return path_dup((const path_t*)(uintptr_t)offset);
+
+	size_t size = 256;
+	size_t len = 0;
+	char* ret = (char*)malloc(size);
+
+	while (1) {
+		ssize_t nread = pread(_sp.path_fd, ret + len, size - len, offset + len);
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("Could not read from spill directory \"%s\": %s.\n", _sp.dir, strerror(errno));
+		}
+
+		if (!nread)
+			fatal("Truncated path file in spill directory \"%s\".\n", _sp.dir);
+
+		if (memchr(ret + len, '\0', nread))
+			return ret;
+
+		len += nread;
+		if (len == size)
+			ret = (char*)realloc(ret, size *= 2);
+	}
+} // }}}
+
+/*****************************************************
+ *
+ * Records
+ *
+ */
+
+static int spill_cmp(const void* _a, const void* _b, void* _s) { // {{{
+
+	const spill_rec* a = (const spill_rec*)_a;
+	const spill_rec* b = (const spill_rec*)_b;
+	int ret = memcmp(a->key, b->key, ((spill_t*)_s)->keylen);
+
+	if (ret)
+		return ret;
+
+	/* hardlinks next to each other */
+	if (a->fi.dev != b->fi.dev)
+		return a->fi.dev < b->fi.dev ? -1 : 1;
+
+	if (a->fi.ino != b->fi.ino)
+		return a->fi.ino < b->fi.ino ? -1 : 1;
+
+	return 0;
+} // }}}
+
+/*****************************************************
+ *
+ * Radix sort
+ *
+ * MSD radix sort, in spill_cmp() order, of <word, index> pairs: word
+ * holds 8 bytes of the key of record index, and is reloaded from the
+ * records only once a bucket has gone through all of them.  Bytes that
+ * all records of a bucket share are skipped without a pass.  The
+ * records are then moved to their place.
+ *
+ */
+
+typedef struct radix_pair { // {{{
+	uint64_t word;
+	uint64_t i;
+} radix_pair; // }}}
+
+typedef struct radix_ctx { // {{{
+	spill_t* s;
+	radix_pair* v;
+	radix_pair* tmp;
+} radix_ctx; // }}}
+
+typedef struct radix_bucket { // {{{
+	size_t start;
+	size_t n;
+	size_t off;
+	int shift;
+} radix_bucket; // }}}
+
+static inline const spill_rec* radix_rec(spill_t* s, uint64_t i) { // {{{
+	return (const spill_rec*)(s->buf + i * s->recsize);
+} // }}}
+
+/* big endian, so that words compare as memcmp() does */
+static inline uint64_t radix_word(spill_t* s, uint64_t i, size_t off) { // {{{
+
+	uint64_t w;
+	memcpy(&w, (const char*)radix_rec(s, i)->key + off, sizeof(w));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+} // }}}
+
+static int radix_pair_cmp(const void* _a, const void* _b, void* _s) { // {{{
+
+	const radix_pair* a = (const radix_pair*)_a;
+	const radix_pair* b = (const radix_pair*)_b;
+	spill_t* s = (spill_t*)_s;
+
+	if (a->word != b->word)
+		return a->word < b->word ? -1 : 1;
+
+	return spill_cmp(radix_rec(s, a->i), radix_rec(s, b->i), s);
+} // }}}
+
+/* Sorts v[start, start + n), whose words hold the key bytes from off, and
+ * are equal above shift.  With deferv, the buckets of the first split are
+ * stored there (as many as returned) instead of being sorted. */
+static size_t radix_sort(radix_ctx* c, size_t start, size_t n, size_t off, int shift, radix_bucket* deferv) { // {{{
+
+	radix_pair* v = c->v + start;
+	spill_t* s = c->s;
+	size_t count[256];
+	size_t i, b, from;
+
+	while (1) {
+
+		if (n < RADIX_CUTOFF) {
+			qsort_r(v, n, sizeof(v[0]), radix_pair_cmp, s);
+			return 0;
+		}
+
+		if (shift < 0) {
+			off += 8;
+
+			/* same key: by <dev,ino> */
+			if (off >= s->keylen) {
+				qsort_r(v, n, sizeof(v[0]), radix_pair_cmp, s);
+				return 0;
+			}
+
+			for (i = 0; i < n; ++i)
+				v[i].word = radix_word(s, v[i].i, off);
+			shift = 56;
+		}
+
+		uint64_t diff = 0;
+		for (i = 1; i < n; ++i)
+			diff |= v[i].word ^ v[0].word;
+
+		if (diff) {
+			shift = 56 - (__builtin_clzll(diff) & ~7);
+			break;
+		}
+
+		shift = -1;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; ++i)
+		count[(v[i].word >> shift) & 0xff]++;
+
+	for (b = 0, from = 0; b < 256; ++b) {
+		size_t bc = count[b];
+		count[b] = from;
+		from += bc;
+	}
+
+	radix_pair* tmp = c->tmp + start;
+	for (i = 0; i < n; ++i)
+		tmp[count[(v[i].word >> shift) & 0xff]++] = v[i];
+	memcpy(v, tmp, n * sizeof(v[0]));
+
+	/* count[b] is now the end of bucket b */
+	size_t deferc = 0;
+	for (b = 0, from = 0; b < 256; from = count[b++]) {
+		if (count[b] - from < 2)
+			continue;
+
+		if (deferv) {
+			radix_bucket* d = &deferv[deferc++];
+			d->start = start + from;
+			d->n = count[b] - from;
+			d->off = off;
+			d->shift = shift - 8;
+		} else
+			radix_sort(c, start + from, count[b] - from, off, shift - 8, NULL);
+	}
+
+	return deferc;
+} // }}}
+
+static void radixJob(void* item, void* cbdata) { // {{{
+	radix_bucket* d = (radix_bucket*)item;
+	radix_sort((radix_ctx*)cbdata, d->start, d->n, d->off, d->shift, NULL);
+} // }}}
+
+/* sorts the buffer; buckets are shared among jobs if parallel */
+static void spill_sort(spill_t* s, int parallel) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	size_t n = s->bufc;
+	size_t i;
+
+	if (n < 2)
+		return;
+
+	radix_ctx c = { s, (radix_pair*)malloc(n * sizeof(radix_pair)), (radix_pair*)malloc(n * sizeof(radix_pair)) };
+
+	for (i = 0; i < n; ++i) {
+		c.v[i].word = radix_word(s, i, 0);
+		c.v[i].i = i;
+	}
+
+	if (parallel && (n >= RADIX_PARALLEL) && (cfg->jobs > 1)) {
+		radix_bucket deferv[256];
+		void* itemv[256];
+		size_t deferc = radix_sort(&c, 0, n, 0, 56, deferv);
+
+		for (i = 0; i < deferc; ++i)
+			itemv[i] = &deferv[i];
+		jobs_run(itemv, deferc, radixJob, &c);
+	} else
+		radix_sort(&c, 0, n, 0, 56, NULL);
+
+	free(c.tmp);
+
+	/* moves the records along the cycles of the permutation */
+	char* rec = (char*)malloc(s->recsize);
+
+	for (i = 0; i < n; ++i) {
+		size_t j = i;
+
+		if (c.v[i].i == i)
+			continue;
+
+		memcpy(rec, s->buf + i * s->recsize, s->recsize);
+		while (c.v[j].i != i) {
+			size_t from = c.v[j].i;
+			memcpy(s->buf + j * s->recsize, s->buf + from * s->recsize, s->recsize);
+			c.v[j].i = j;
+			j = from;
+		}
+		memcpy(s->buf + j * s->recsize, rec, s->recsize);
+		c.v[j].i = j;
+	}
+
+	free(rec);
+	free(c.v);
+} // }}}
+
+spill_t* spill_new(size_t keylen) { // {{{
+
+	spill_t* s = (spill_t*)calloc(1, sizeof(spill_t));
+
+	s->keylen = keylen;
+	s->recsize = sizeof(spill_rec) + ((keylen + 7) & ~(size_t)7);
+	s->buf_size = _sp.max_memory / s->recsize;
+	if (s->buf_size < SPILL_MIN_RECS)
+		s->buf_size = SPILL_MIN_RECS;
+
+	return s;
+} // }}}
+
+static void spill_run_add(spill_t* s, int fd, uint64_t recc) { // {{{
+	s->runv = (spill_run*)realloc(s->runv, (s->runc + 1) * sizeof(s->runv[0]));
+	s->runv[s->runc].fd = fd;
+	s->runv[s->runc].recc = recc;
+	s->runc++;
+} // }}}
+
+/* sorts the buffer, and writes it as a new run */
+static void spill_flush(spill_t* s, int parallel) { // {{{
+
+	if (!s->bufc)
+		return;
+
+	spill_sort(s, parallel);
+
+	int fd = spill_tmpfile();
+	write_all(fd, s->buf, s->bufc * s->recsize);
+	spill_run_add(s, fd, s->bufc);
+
+	debug("spill: run %lu, %lu records.", (unsigned long)s->runc, (unsigned long)s->bufc);
+
+	s->bufc = 0;
+} // }}}
+
+void spill_add(spill_t* s, const finfo_t* fi, uint64_t path, const long* key) { // {{{
+
+	if (!s->buf)
+		s->buf = (char*)malloc(s->buf_size * s->recsize);
+
+	if (s->bufc == s->buf_size) {
+		if (_sp.dir)
+			spill_flush(s, 0);
+		else
+			s->buf = (char*)realloc(s->buf, (s->buf_size *= 2) * s->recsize);
+	}
+
+	spill_rec* r = (spill_rec*)(s->buf + s->bufc++ * s->recsize);
+
+	memset(r, 0, s->recsize);
+	r->fi = *fi;
+	r->path = path;
+	memcpy(r->key, key, key[0]);
+
+} // }}}
+
+/*****************************************************
+ *
+ * Merging runs
+ *
+ */
+
+typedef struct spill_reader { // {{{
+	int fd;
+	off_t offset;
+	uint64_t left;      /** records still in the file */
+	char* buf;
+	size_t bufc;
+	size_t ibuf;
+} spill_reader; // }}}
+
+typedef void (*spill_out_fn)(const char* rec, void* cbdata);
+
+/* 0 once the run is exhausted */
+static int reader_fill(spill_reader* r, size_t recsize) { // {{{
+
+	size_t recc = SPILL_IO_SIZE / recsize;
+	if (recc > r->left)
+		recc = r->left;
+
+	size_t len = 0;
+	while (len < recc * recsize) {
+		ssize_t nread = pread(r->fd, r->buf + len, recc * recsize - len, r->offset + len);
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("Could not read from spill directory \"%s\": %s.\n", _sp.dir, strerror(errno));
+		}
+
+		if (!nread)
+			fatal("Truncated run in spill directory \"%s\".\n", _sp.dir);
+
+		len += nread;
+	}
+
+	r->offset += len;
+	r->left -= recc;
+	r->bufc = recc;
+	r->ibuf = 0;
+
+	return recc > 0;
+} // }}}
+
+static inline const char* reader_rec(spill_reader* r, size_t recsize) { // {{{
+	return r->buf + r->ibuf * recsize;
+} // }}}
+
+static void heap_down(spill_t* s, spill_reader** heap, size_t heapc, size_t i) { // {{{
+
+	while (1) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+
+		if ((l < heapc) && (spill_cmp(reader_rec(heap[l], s->recsize), reader_rec(heap[min], s->recsize), s) < 0))
+			min = l;
+
+		if ((r < heapc) && (spill_cmp(reader_rec(heap[r], s->recsize), reader_rec(heap[min], s->recsize), s) < 0))
+			min = r;
+
+		if (min == i)
+			return;
+
+		spill_reader* t = heap[i];
+		heap[i] = heap[min];
+		heap[min] = t;
+		i = min;
+	}
+} // }}}
+
+/* merges runv[0, runc) in order into out(), and closes them */
+static void spill_merge(spill_t* s, spill_run* runv, size_t runc, spill_out_fn out, void* cbdata) { // {{{
+
+	spill_reader* readerv = (spill_reader*)calloc(runc, sizeof(spill_reader));
+	spill_reader** heap = (spill_reader**)malloc(runc * sizeof(heap[0]));
+	size_t heapc = 0;
+	size_t i;
+
+	for (i = 0; i < runc; ++i) {
+		spill_reader* r = &readerv[i];
+		r->fd = runv[i].fd;
+		r->left = runv[i].recc;
+		r->buf = (char*)malloc(SPILL_IO_SIZE);
+		if (reader_fill(r, s->recsize))
+			heap[heapc++] = r;
+	}
+
+	for (i = heapc; i-- > 0; )
+		heap_down(s, heap, heapc, i);
+
+	while (heapc) {
+		spill_reader* r = heap[0];
+
+		out(reader_rec(r, s->recsize), cbdata);
+
+		if ((++r->ibuf == r->bufc) && !reader_fill(r, s->recsize))
+			heap[0] = heap[--heapc];
+
+		heap_down(s, heap, heapc, 0);
+	}
+
+	for (i = 0; i < runc; ++i) {
+		close(readerv[i].fd);
+		free(readerv[i].buf);
+	}
+
+	free(heap);
+	free(readerv);
+} // }}}
+
+typedef struct spill_writer { // {{{
+	int fd;
+	char* buf;
+	size_t len;
+	uint64_t recc;
+	size_t recsize;
+} spill_writer; // }}}
+
+static void writer_out(const char* rec, void* cbdata) { // {{{
+
+	spill_writer* w = (spill_writer*)cbdata;
+
+	if (w->len + w->recsize > SPILL_IO_SIZE) {
+		write_all(w->fd, w->buf, w->len);
+		w->len = 0;
+	}
+
+	memcpy(w->buf + w->len, rec, w->recsize);
+	w->len += w->recsize;
+	w->recc++;
+} // }}}
+
+typedef struct spill_grouper { // {{{
+	spill_t* s;
+	char* recv;
+	size_t recc;
+	size_t recv_size;
+	spill_group_fn fn;
+	void* cbdata;
+} spill_grouper; // }}}
+
+static void grouper_flush(spill_grouper* g) { // {{{
+	if (g->recc)
+		g->fn(g->recv, g->recc, g->s->recsize, g->cbdata);
+	g->recc = 0;
+} // }}}
+
+static void grouper_out(const char* rec, void* cbdata) { // {{{
+
+	spill_grouper* g = (spill_grouper*)cbdata;
+	size_t recsize = g->s->recsize;
+
+	if (g->recc && memcmp(((spill_rec*)g->recv)->key, ((spill_rec*)rec)->key, g->s->keylen))
+		grouper_flush(g);
+
+	if (g->recc == g->recv_size) {
+		g->recv_size = g->recv_size ? 2 * g->recv_size : 16;
+		g->recv = (char*)realloc(g->recv, g->recv_size * recsize);
+	}
+
+	memcpy(g->recv + g->recc++ * recsize, rec, recsize);
+} // }}}
+
+void spill_groups(spill_t* s, spill_group_fn fn, void* cbdata) { // {{{
+
+	if (!s->runc) {
+
+		/* it all fit in memory */
+		size_t start = 0;
+		size_t i;
+
+		spill_sort(s, 1);
+
+		for (i = 1; i <= s->bufc; ++i) {
+			if ((i == s->bufc) ||
+			    memcmp(((spill_rec*)(s->buf + start * s->recsize))->key,
+				   ((spill_rec*)(s->buf + i * s->recsize))->key, s->keylen)) {
+				fn(s->buf + start * s->recsize, i - start, s->recsize, cbdata);
+				start = i;
+			}
+		}
+
+	} else {
+
+		spill_flush(s, 1);
+		free(s->buf);
+		s->buf = NULL;
+
+		/* fewer runs than SPILL_FANIN, so the last merge has a buffer
+		 * for each */
+		while (s->runc > SPILL_FANIN) {
+
+			spill_writer w = { spill_tmpfile(), (char*)malloc(SPILL_IO_SIZE), 0, 0, s->recsize };
+
+			spill_merge(s, s->runv, SPILL_FANIN, writer_out, &w);
+			write_all(w.fd, w.buf, w.len);
+			free(w.buf);
+
+			memmove(s->runv, s->runv + SPILL_FANIN, (s->runc - SPILL_FANIN) * sizeof(s->runv[0]));
+			s->runc -= SPILL_FANIN;
+			spill_run_add(s, w.fd, w.recc);
+		}
+
+		spill_grouper g = { s, NULL, 0, 0, fn, cbdata };
+
+		spill_merge(s, s->runv, s->runc, grouper_out, &g);
+		grouper_flush(&g);
+		free(g.recv);
+
+	}
+
+	free(s->runv);
+	free(s->buf);
+	free(s);
+
+} // }}}
@@ -0,0 +1,73 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __FILEDEDUP_SPILL_H
+#define __FILEDEDUP_SPILL_H
+
+#include "finfo.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * --group=radix and --spill-dir: files are classified by radix sorting
+ * fixed-width records instead of through in-memory hash tables.
+ *
+ * The records of a step are gathered in a buffer.  With a spill
+ * directory it holds up to --max-memory bytes, and whenever it fills up
+ * it is sorted and written to a run file there.  spill_groups() then
+ * merges the runs (in passes of at most SPILL_FANIN of them) and streams
+ * the groups of records with the same key.  Paths are written once, to a
+ * path file, and records refer to them by offset.
+ *
+ * Without a spill directory (spill_setup(NULL, 0)), the buffer grows as
+ * needed, is sorted once, and records refer to paths of the path store.
+ *
+ * Files in the spill directory are unlinked as soon as they are created.
+ * Nothing here is thread safe; callers hold the state lock.
+ *
+ */
+
+typedef struct spill_rec {
+	finfo_t fi;
+	uint64_t path;   /** offset in the path file */
+	long key[];      /** the key of the step; key[0] is its length */
+} spill_rec;
+
+typedef struct spill_t spill_t;
+
+void spill_setup(const char* dir, size_t max_memory);
+
+uint64_t spill_path_add(const char* path);
+void spill_path_sync();                  /** before spill_path() is called */
+char* spill_path(uint64_t offset);       /** malloc'd; may be called from any thread */
+
+spill_t* spill_new(size_t keylen);       /** keylen: key_size() of the step */
+void spill_add(spill_t* s, const finfo_t* fi, uint64_t path, const long* key);
+
+/* recv holds recc records of recsize bytes each, sorted by <dev,ino> */
+typedef void (*spill_group_fn)(char* recv, size_t recc, size_t recsize, void* cbdata);
+
+void spill_groups(spill_t* s, spill_group_fn fn, void* cbdata);  /** and deletes s */
+
+#define SPILL_REC(recv, recsize, i) ((spill_rec*)((recv) + (i) * (recsize)))
+
+#endif
@@ -30,44 +30,47 @@ devino_t* devino_init(devino_t* di, dev_t dev, ino_t inode) { // {{{
 } // }}}
 
 cluster_t* cluster_init(cluster_t* c) { // {{{
-	htable_init(&c->files, 0);
+	c->filev = c->inlinev;
+	c->filec = 0;
+	c->filev_size = CLUSTER_INLINE_FILES;
 	return c;
 } // }}}
 
-cluster_t* cluster_new() { // {{{
-	return cluster_init((cluster_t*)calloc(1, sizeof(cluster_t)));
+cluster_t* cluster_new(arena* a) { // {{{
+	return cluster_init((cluster_t*)arena_alloc(a, sizeof(cluster_t)));
 } // }}}
 
-void* cluster_destroy(cluster_t* c) { // {{{
-	htable_destroy(&c->files);
-	return c;
-} // }}}
+void cluster_add(cluster_t* c, arena* a, file_t* f) { // {{{
+
+	if (c->filec == c->filev_size) {
+		/* the old array stays in the arena until the step ends */
+		file_t** filev = (file_t**)arena_alloc(a, 2 * c->filev_size * sizeof(filev[0]));
+		memcpy(filev, c->filev, c->filec * sizeof(filev[0]));
+		c->filev = filev;
+		c->filev_size *= 2;
+	}
+
+	c->filev[c->filec++] = f;
 
-void cluster_delete(cluster_t* c) { // {{{
-	free(cluster_destroy(c));
 } // }}}
 
-file_t* file_new(const char* path, struct stat* st, cluster_t* cluster) { // {{{
-	file_t* f = (file_t*)calloc(1, sizeof(file_t));
+file_t* file_new(arena* a, const path_t* path, const char* filename, finfo_t* fi, cluster_t* cluster) { // {{{
+	file_t* f = (file_t*)arena_calloc(a, sizeof(file_t));
 
-	f->path = strdup(path);
-	memcpy(&f->st, st, sizeof(f->st));
+	f->path = path ? path : path_intern(filename);
+	f->fi = *fi;
 	f->cluster = cluster;
-
-	f->key = NULL;
+	f->resume = NULL;
 
 	return f;
 } // }}}
 
 void* file_destroy(file_t* f) { // {{{
-	free((void*)f->path);
+	digest_resume_delete(f->resume);
+	f->resume = NULL;
 	return f;
 } // }}}
 
-void file_delete(file_t* f) { // {{{
-	free(file_destroy(f));
-} // }}}
-
 run_state* state() { // {{{
 	static run_state s;
 	return &s;
@@ -78,8 +81,9 @@ run_state* state_init(run_state* r) { // {{{
 	r->idiscriminant = 0;
 	r->saved = 0;
 
-	htable_init(&r->filesByDevIno, 8);
-	htable_init(&r->clustersByKey, 8);
+	devino2file_init(&r->filesByDevIno, 8);
+	key2cluster_init(&r->clustersByKey, 8);
+	arena_init(&r->mem, 0);
 
 	return r;
 } // }}}
@@ -89,7 +93,7 @@ void state_setup() { // {{{
 
 	run_state* s = state_init(state());
 
-	digest_setup(cfg->discriminantv[s->idiscriminant].methods);
+	digest_setup(&cfg->discriminantv[s->idiscriminant]);
 } // }}}
 
 int state_next_step(run_state* old) { // {{{
@@ -103,15 +107,35 @@ int state_next_step(run_state* old) { // {{{
 	if (++s->idiscriminant == cfg->discriminantc)
 		return 0;
 
-	htable_init(&s->filesByDevIno, 8);
-	htable_init(&s->clustersByKey, 8);
+	devino2file_init(&s->filesByDevIno, 8);
+	key2cluster_init(&s->clustersByKey, 8);
+	arena_init(&s->mem, 0);
 
-	digest_setup(cfg->discriminantv[s->idiscriminant].methods);
+	digest_setup(&cfg->discriminantv[s->idiscriminant]);
 
 	return 1;
 
 } // }}}
 
+void state_rewind() { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	run_state* s = state();
+
+	htable_destroy(&s->filesByDevIno);
+	htable_destroy(&s->clustersByKey);
+	arena_destroy(&s->mem);
+
+	s->idiscriminant = 0;
+	devino2file_init(&s->filesByDevIno, 8);
+	key2cluster_init(&s->clustersByKey, 8);
+	arena_init(&s->mem, 0);
+
+	digest_setup(&cfg->discriminantv[0]);
+
+} // }}}
+
 struct discriminant_t* current_discriminant() { // {{{
 
 	CACHED_CONFIG(cfg);
@@ -127,7 +151,14 @@ struct discriminant_t* current_discriminant() { // {{{
 
 } // }}}
 
-DEFINE_HTABLE_TYPE_KL(clfiles, char, file_t);
-DEFINE_HTABLE_TYPE(devino2file, devino_t, file_t);
-DEFINE_HTABLE_TYPE_KL(key2cluster, long, cluster_t);
+static inline uint64_t devino_hash(devino_t* di) { // {{{
+	return htable_hash64(di->inode * 0x9E3779B97F4A7C15ULL ^ di->dev);
+} // }}}
+
+static inline uint64_t cluster_key_hash(long* key, size_t keylen) { // {{{
+	return key_hash(current_discriminant(), key, keylen);
+} // }}}
+
+DEFINE_HTABLE_TYPE_H(devino2file, devino_t, file_t, devino_hash, NULL);
+DEFINE_HTABLE_TYPE_KL_H(key2cluster, long, cluster_t, cluster_key_hash, NULL);
 
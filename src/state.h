@@ -23,6 +23,8 @@
 
 #include "discriminant.h"
 #include "htable.h"
+#include "arena.h"
+#include "pathstore.h"
 
 #include <stdint.h>
 
@@ -37,27 +39,32 @@ struct devino_t {
 
 devino_t* devino_init(devino_t* di, dev_t dev, ino_t inode);
 
+#define CLUSTER_INLINE_FILES 2
+
+/* Most clusters have a single file: the first ones are kept inline, and
+ * filev only moves to an array of its own when they don't fit. */
 struct cluster_t {
-	htable files; // key=path (char*), vale=file_t*
+	file_t** filev;     /** inlinev, or a bigger array */
+	uint32_t filec;
+	uint32_t filev_size;
+	file_t* inlinev[CLUSTER_INLINE_FILES];
 };
 
+/* clusters and files live in the arena of their step: nothing to free */
 cluster_t* cluster_init(cluster_t* c);
-cluster_t* cluster_new();
-void cluster_delete(cluster_t*);
-
-/* clfiles: cluster files */
-DECLARE_HTABLE_TYPE_KL(clfiles, char, file_t);
+cluster_t* cluster_new(arena* a);
+void cluster_add(cluster_t* c, arena* a, file_t* f);
 
 struct file_t {
-	const char* path;
-	struct stat st;
+	const path_t* path;      /** in the path store */
+	finfo_t fi;
 	cluster_t* cluster;
-	long* key;
+	digest_resume_t* resume; /** digest state carried to the next step */
 };
 
-file_t* file_new(const char* path, struct stat* st, cluster_t* cluster);
-void* file_destroy(file_t* f);
-void file_delete(file_t* f);
+/* filename is interned if path is NULL */
+file_t* file_new(arena* a, const path_t* path, const char* filename, finfo_t* fi, cluster_t* cluster);
+void* file_destroy(file_t* f); /** releases the digest state it may have */
 
 typedef struct run_state {
 	int idiscriminant;        /** current discriminant index */
@@ -65,14 +72,18 @@ typedef struct run_state {
 
 	htable filesByDevIno;     /** files[dev,ino] */
 	htable clustersByKey;     /** cluster[key]   */
+
+	arena mem;                /** files, clusters and keys of this step */
 } run_state;
 
-DECLARE_HTABLE_TYPE(devino2file, devino_t, file_t);
-DECLARE_HTABLE_TYPE_KL(key2cluster, long, cluster_t);
+/* devino_t keys are kept inline; cluster keys are hashed by key_hash() */
+DECLARE_HTABLE_TYPE_H(devino2file, devino_t, file_t);
+DECLARE_HTABLE_TYPE_KL_H(key2cluster, long, cluster_t);
 
 run_state* state();
 void state_setup();
 int state_next_step();
+void state_rewind();      /** back to step 0, freeing the tables of the current one */
 
 #define CACHED_STATE(st)                             \
 	static struct run_state* st = NULL;          \
@@ -22,9 +22,47 @@
 #include "memory.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
 
+/* typed tables: a 16 byte key (inline), a 24 byte one (by pointer), and
+ * variable length keys; all with hashes that collide a lot */
+typedef struct key16 {
+	uint64_t a;
+	uint64_t b;
+} key16;
+
+typedef struct key24 {
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+} key24;
+
+static inline uint64_t key16_hash(key16* k) {
+	return htable_hash64(k->a % 8);
+}
+
+static inline uint64_t key24_hash(key24* k) {
+	return k->a % 4;
+}
+
+static int key24_eq(const key24* x, const key24* y, size_t keylen) {
+	assert(keylen == sizeof(key24));
+	return (x->a == y->a) && (x->b == y->b) && (x->c == y->c);
+}
+
+static inline uint64_t kl_hash(long* key, size_t keylen) {
+	return keylen;
+}
+
+DECLARE_HTABLE_TYPE_H(k16, key16, int)
+DEFINE_HTABLE_TYPE_H(k16, key16, int, key16_hash, NULL)
+DECLARE_HTABLE_TYPE_H(k24, key24, int)
+DEFINE_HTABLE_TYPE_H(k24, key24, int, key24_hash, key24_eq)
+DECLARE_HTABLE_TYPE_KL_H(kl, long, int)
+DEFINE_HTABLE_TYPE_KL_H(kl, long, int, kl_hash, NULL)
+
 int check(void* key, size_t keylen, void* data, size_t dlen, void* cbdata) {
 	assert(keylen == sizeof(int));
 	assert(!cbdata);
@@ -48,6 +86,184 @@ void show_counth(htable* ht) {
 		fprintf(stdout, "[%d] = %u\n", i, countv[i]);
 }
 
+/* Keys sharing one hash fill a whole group of 16 slots, and spill into
+ * the next one.  An unset in the full group must leave a tombstone, or
+ * the keys past it would no longer be found. */
+void test_tombstones() {
+
+	static int keyv[40];
+	htable ht;
+	void* data;
+	size_t dlen;
+	int i, ret;
+
+	htable_init(&ht, 64);
+
+	for (i = 0; i < 20; ++i) {
+		keyv[i] = i;
+		ret = htable_add_h(&ht, &keyv[i], sizeof(keyv[i]), &keyv[i], sizeof(keyv[i]), 42);
+		assert(ret == HTABLE_FOUND);
+	}
+
+	ret = htable_unset_h(&ht, &keyv[3], sizeof(keyv[3]), 42, &data, &dlen);
+	assert(ret == HTABLE_FOUND);
+	assert(data == &keyv[3]);
+	assert(ht.entries == 19);
+
+	for (i = 0; i < 20; ++i) {
+		ret = htable_find_h(&ht, &keyv[i], sizeof(keyv[i]), 42, &data, &dlen);
+		assert(ret == ((i == 3) ? HTABLE_NOT_FOUND : HTABLE_FOUND));
+		assert((i == 3) || (data == &keyv[i]));
+	}
+
+	/* reinserted, into the tombstone or past it */
+	ret = htable_add_h(&ht, &keyv[3], sizeof(keyv[3]), &keyv[3], sizeof(keyv[3]), 42);
+	assert(ret == HTABLE_FOUND);
+	ret = htable_add_h(&ht, &keyv[3], sizeof(keyv[3]), &keyv[3], sizeof(keyv[3]), 42);
+	assert(ret == HTABLE_NOT_FOUND);
+	assert(ht.entries == 20);
+
+	/* tombstones again, then enough keys (with their own hashes) to
+	 * rehash the table, which drops them */
+	for (i = 0; i < 20; i += 4) {
+		ret = htable_unset_h(&ht, &keyv[i], sizeof(keyv[i]), 42, &data, &dlen);
+		assert(ret == HTABLE_FOUND);
+	}
+
+	size_t capacity = ht.capacity;
+
+	for (i = 20; i < 40; ++i) {
+		keyv[i] = i;
+		ret = htable_add(&ht, &keyv[i], sizeof(keyv[i]), &keyv[i], sizeof(keyv[i]));
+		assert(ret == HTABLE_FOUND);
+	}
+	for (i = 0; i < 1000; ++i) {
+		int* k = (int*)xmemdup(&i, sizeof(i));
+		*k += 1000;
+		ret = htable_add(&ht, k, sizeof(*k), k, sizeof(*k));
+		assert(ret == HTABLE_FOUND);
+	}
+	assert(ht.capacity > capacity);
+	assert(ht.entries == 15 + 20 + 1000);
+
+	for (i = 0; i < 20; ++i) {
+		ret = htable_find_h(&ht, &keyv[i], sizeof(keyv[i]), 42, &data, &dlen);
+		assert(ret == ((i % 4) ? HTABLE_FOUND : HTABLE_NOT_FOUND));
+	}
+	for (i = 20; i < 40; ++i) {
+		ret = htable_find(&ht, &keyv[i], sizeof(keyv[i]), &data, &dlen);
+		assert(ret == HTABLE_FOUND);
+		assert(data == &keyv[i]);
+	}
+
+	for (i = 1000; i < 2000; ++i) {
+		ret = htable_unset(&ht, &i, sizeof(i), &data, &dlen);
+		assert(ret == HTABLE_FOUND);
+		free(data);
+	}
+
+	htable_destroy(&ht);
+}
+
+#define TYPEDC 300
+
+void test_typed() {
+
+	static int valuev[TYPEDC];
+	static key24 k24v[TYPEDC];
+	static long klv[TYPEDC][4];
+	htable ht16, ht24, htkl;
+	int* value;
+	int i, ret;
+
+	k16_init(&ht16, 0);
+	k24_init(&ht24, 0);
+	kl_init(&htkl, 0);
+
+	assert(ht16.inline_klen == sizeof(key16));
+	assert(ht24.inline_klen == 0);
+
+	for (i = 0; i < TYPEDC; ++i) {
+		valuev[i] = i;
+
+		/* copied into the slot: the caller's key can go */
+		key16 k16 = { i, ~(uint64_t)i };
+		ret = k16_add(&ht16, &k16, &valuev[i]);
+		assert(ret == HTABLE_FOUND);
+		memset(&k16, 0xff, sizeof(k16));
+
+		/* kept by pointer */
+		k24v[i].a = i;
+		k24v[i].b = 2 * i;
+		k24v[i].c = 3 * i;
+		ret = k24_add(&ht24, &k24v[i], &valuev[i]);
+		assert(ret == HTABLE_FOUND);
+
+		/* keys of 1 to 4 longs, hashed by their length only */
+		klv[i][0] = klv[i][1] = klv[i][2] = klv[i][3] = i;
+		ret = kl_add(&htkl, klv[i], (1 + i % 4) * sizeof(long), &valuev[i]);
+		assert(ret == HTABLE_FOUND);
+	}
+
+	for (i = 0; i < TYPEDC; ++i) {
+		key16 k16 = { i, ~(uint64_t)i };
+		ret = k16_find(&ht16, &k16, &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+		ret = k16_add(&ht16, &k16, &valuev[i]);
+		assert(ret == HTABLE_NOT_FOUND);
+
+		/* same hash, not the same key */
+		k16.b++;
+		ret = k16_find(&ht16, &k16, &value);
+		assert(ret == HTABLE_NOT_FOUND);
+
+		key24 k24 = k24v[i];
+		ret = k24_find(&ht24, &k24, &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+		k24.c++;
+		ret = k24_find(&ht24, &k24, &value);
+		assert(ret == HTABLE_NOT_FOUND);
+
+		long kl[4] = { i, i, i, i };
+		ret = kl_find(&htkl, kl, (1 + i % 4) * sizeof(long), &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+		ret = kl_find(&htkl, kl, (1 + (i + 1) % 4) * sizeof(long), &value);
+		assert(ret == HTABLE_NOT_FOUND);
+	}
+
+	/* half of them out, among colliding keys */
+	for (i = 0; i < TYPEDC; i += 2) {
+		key16 k16 = { i, ~(uint64_t)i };
+		ret = k16_unset(&ht16, &k16, &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+
+		ret = k24_unset(&ht24, &k24v[i], &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+
+		ret = kl_unset(&htkl, klv[i], (1 + i % 4) * sizeof(long), &value);
+		assert((ret == HTABLE_FOUND) && (value == &valuev[i]));
+	}
+	assert(ht16.entries == TYPEDC / 2);
+	assert(ht24.entries == TYPEDC / 2);
+	assert(htkl.entries == TYPEDC / 2);
+
+	for (i = 0; i < TYPEDC; ++i) {
+		key16 k16 = { i, ~(uint64_t)i };
+		int expected = (i % 2) ? HTABLE_FOUND : HTABLE_NOT_FOUND;
+
+		ret = k16_find(&ht16, &k16, &value);
+		assert(ret == expected);
+		ret = k24_find(&ht24, &k24v[i], &value);
+		assert(ret == expected);
+		ret = kl_find(&htkl, klv[i], (1 + i % 4) * sizeof(long), &value);
+		assert(ret == expected);
+	}
+
+	htable_destroy(&htkl);
+	htable_destroy(&ht24);
+	htable_destroy(&ht16);
+}
+
 int main(int argc, char* argv[]) {
 
 	htable ht;
@@ -72,7 +288,43 @@ int main(int argc, char* argv[]) {
 
 	htable_foreach(&ht, check, NULL);
 
+	/* every other entry removed: the rest must still be found, also
+	 * after the tombstones are reused by new entries */
+	for (i = 0; i < 1000; i += 2) {
+		void* data = NULL;
+		size_t dlen = 0;
+		int ret = htable_unset(&ht, &i, sizeof(i), &data, &dlen);
+		assert(ret == HTABLE_FOUND);
+		assert(dlen == strlen((char*)data) + 1);
+		free(data);
+	}
+	assert(ht.entries == 500);
+
+	for (i = 0; i < 1000; ++i) {
+		void* data = NULL;
+		size_t dlen = 0;
+		int ret = htable_find(&ht, &i, sizeof(i), &data, &dlen);
+		assert(ret == ((i % 2) ? HTABLE_FOUND : HTABLE_NOT_FOUND));
+	}
+
+	for (i = 0; i < 1000; i += 2) {
+		char* k = NULL;
+		asprintf(&k, "%ld %d", rand(), i);
+		int ret = htable_add(&ht, xmemdup(&i, sizeof(i)), sizeof(i), k, strlen(k)+1);
+		assert(ret == HTABLE_FOUND);
+	}
+	assert(ht.entries == 1000);
+
+	i = 1;
+	int ret = htable_add(&ht, &i, sizeof(i), NULL, 0);
+	assert(ret == HTABLE_NOT_FOUND);
+
+	htable_foreach(&ht, check, NULL);
+
 	htable_destroy(&ht);
 
+	test_tombstones();
+	test_typed();
+
 }
 
@@ -0,0 +1,149 @@
+
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "xxh3.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+/* reference XXH3_64bits() of the first len bytes of fill()'s buffer:
+ * across the 0-16, 17-128, 129-240 and long branches, and several
+ * 1024 byte blocks (scrambles) */
+static const struct {
+	size_t len;
+	uint64_t hash;
+} vectorv[] = {
+	{     1, 0x858266ce1aa38806ULL },
+	{     3, 0x0539a1442b1072c8ULL },
+	{     4, 0x174ec0d87e60c145ULL },
+	{     8, 0x8bd3f9613a164dd9ULL },
+	{     9, 0x288230cbf6769150ULL },
+	{    16, 0x7244e5428eb3b96aULL },
+	{    17, 0x00b0c670c8534a93ULL },
+	{    64, 0x99df36f18cfe3391ULL },
+	{   100, 0x5ec8a4e8c5674428ULL },
+	{   128, 0x6152a910094d4e57ULL },
+	{   129, 0x80b40067051ba1d6ULL },
+	{   200, 0xc0667346e8b2c540ULL },
+	{   240, 0x859419d18b806359ULL },
+	{   241, 0xf64231b9b08b47e8ULL },
+	{   255, 0x29fef4abb0ef78ceULL },
+	{   256, 0x124196e7627e39d5ULL },
+	{  1023, 0xff86273367fa73f3ULL },
+	{  1024, 0x12dec71386ba6594ULL },
+	{  1025, 0xc5523bc198725df8ULL },
+	{  2048, 0xffd1e50887ab07aeULL },
+	{  4103, 0x1fed36f77dc40b7eULL },
+	{ 12345, 0xf57df4e958885a52ULL },
+};
+
+#define BUFLEN 12345
+
+/* xorshift64, top byte of each step */
+void fill(unsigned char* buf, size_t len) {
+	uint64_t g = 0x9E3779B185EBCA8DULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		g ^= g << 13;
+		g ^= g >> 7;
+		g ^= g << 17;
+		buf[i] = g >> 56;
+	}
+}
+
+uint64_t final(xxh3_state_t* s) {
+	unsigned char out[XXH3_DIGEST_LENGTH];
+	uint64_t h = 0;
+	int i;
+
+	xxh3_final(s, out);
+	for (i = 0; i < XXH3_DIGEST_LENGTH; ++i)
+		h = (h << 8) | out[i];
+
+	return h;
+}
+
+uint64_t hash(const void* b, size_t len) {
+	xxh3_state_t s;
+
+	xxh3_init(&s);
+	xxh3_update(&s, b, len);
+
+	return final(&s);
+}
+
+/* the same bytes, fed step bytes at a time */
+uint64_t hash_split(const unsigned char* b, size_t len, size_t step) {
+	xxh3_state_t s;
+	size_t off = 0;
+
+	xxh3_init(&s);
+	for (; off < len; off += step)
+		xxh3_update(&s, b + off, len - off < step ? len - off : step);
+
+	return final(&s);
+}
+
+void check(const char* what, size_t len, uint64_t got, uint64_t expected) {
+	if (got == expected)
+		return;
+
+	fprintf(stderr, "%s: %s, len %lu: %016llx, expected %016llx\n", xxh3_kernel(), what,
+			(unsigned long)len, (unsigned long long)got, (unsigned long long)expected);
+	assert(got == expected);
+}
+
+int main(int argc, char* argv[]) {
+
+	static const char* kernelv[] = { "scalar", "sse2", "avx2", "avx512" };
+	static const size_t stepv[] = { 1, 7, 63, 64, 255, 256, 1000 };
+	unsigned char buf[BUFLEN];
+	size_t k, i, j;
+
+	fill(buf, sizeof(buf));
+
+	for (k = 0; k < sizeof(kernelv)/sizeof(kernelv[0]); ++k) {
+
+		if (!xxh3_set_kernel(kernelv[k])) {
+			fprintf(stdout, "%s: not supported, skipped\n", kernelv[k]);
+			continue;
+		}
+
+		check("\"\"", 0, hash("", 0), 0x2d06800538d394c2ULL);
+		check("\"a\"", 1, hash("a", 1), 0xe6c632b61e964e1fULL);
+		check("\"abc\"", 3, hash("abc", 3), 0x78af5f94892f3950ULL);
+
+		for (i = 0; i < sizeof(vectorv)/sizeof(vectorv[0]); ++i) {
+			size_t len = vectorv[i].len;
+
+			check("single", len, hash(buf, len), vectorv[i].hash);
+
+			for (j = 0; j < sizeof(stepv)/sizeof(stepv[0]); ++j)
+				check("split", len, hash_split(buf, len, stepv[j]), vectorv[i].hash);
+		}
+
+		fprintf(stdout, "%s: ok\n", xxh3_kernel());
+	}
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "uring.h"
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) { // {{{
+	return syscall(__NR_io_uring_setup, entries, p);
+} // }}}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) { // {{{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+} // }}}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) { // {{{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+} // }}}
+
+int uring_init(uring* r, unsigned entries) { // {{{
+
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+
+	if ((r->sq_ptr == MAP_FAILED) || (r->cq_ptr == MAP_FAILED) || (r->sqes == MAP_FAILED)) {
+		int err = errno;
+		uring_destroy(r);
+		return -err;
+	}
+
+	char* sq = (char*)r->sq_ptr;
+	r->sq_head = (unsigned*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+	char* cq = (char*)r->cq_ptr;
+	r->cq_head = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return 0;
+} // }}}
+
+void uring_destroy(uring* r) { // {{{
+
+	if (r->sq_ptr && (r->sq_ptr != MAP_FAILED))
+		munmap(r->sq_ptr, r->sq_len);
+
+	if (r->cq_ptr && (r->cq_ptr != MAP_FAILED))
+		munmap(r->cq_ptr, r->cq_len);
+
+	if (r->sqes && (r->sqes != MAP_FAILED))
+		munmap(r->sqes, r->sqes_len);
+
+	if (r->fd >= 0)
+		close(r->fd);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+} // }}}
+
+int uring_supports(uring* r, int op) { // {{{
+
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, len);
+	int ret = 0;
+
+	if (io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+		ret = (op <= probe->last_op) && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return ret;
+} // }}}
+
+struct io_uring_sqe* uring_sqe(uring* r) { // {{{
+
+	unsigned head = load_acquire(r->sq_head);
+	unsigned tail = *r->sq_tail + r->sq_pending;
+
+	if (tail - head > *r->sq_mask)
+		return NULL;
+
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[i];
+
+	r->sq_array[i] = i;
+	r->sq_pending++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+} // }}}
+
+int uring_submit(uring* r, unsigned wait_nr) { // {{{
+
+	unsigned to_submit = r->sq_pending;
+
+	store_release(r->sq_tail, *r->sq_tail + to_submit);
+	r->sq_pending = 0;
+
+	while (1) {
+		int ret = io_uring_enter(r->fd, to_submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0);
+
+		if ((ret < 0) && (errno == EINTR)) {
+			to_submit = 0;
+			continue;
+		}
+
+		return ret < 0 ? -errno : ret;
+	}
+} // }}}
+
+int uring_cqe(uring* r, struct io_uring_cqe* cqe) { // {{{
+
+	unsigned head = *r->cq_head;
+
+	if (head == load_acquire(r->cq_tail))
+		return 0;
+
+	*cqe = r->cqes[head & *r->cq_mask];
+	store_release(r->cq_head, head + 1);
+
+	return 1;
+} // }}}
@@ -0,0 +1,63 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_URING_H
+#define __FILEDEDUP_URING_H
+
+#include <linux/io_uring.h>
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * Minimal io_uring(7) wrapper, straight on top of the syscalls (no
+ * liburing needed).  One ring per thread; not thread safe.
+ *
+ */
+
+typedef struct uring {
+	int fd;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned sq_pending;   /** sqes filled but not yet submitted */
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+} uring;
+
+int uring_init(uring* r, unsigned entries);   /** 0 or -errno                     */
+void uring_destroy(uring* r);
+int uring_supports(uring* r, int op);          /** 1 if the kernel knows IORING_OP_* */
+
+struct io_uring_sqe* uring_sqe(uring* r);      /** NULL if the queue is full       */
+int uring_submit(uring* r, unsigned wait_nr);  /** submits, waits for wait_nr cqes */
+int uring_cqe(uring* r, struct io_uring_cqe* cqe); /** pops one cqe, 0 if none     */
+
+#endif
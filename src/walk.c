@@ -0,0 +1,476 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE
+#include "walk.h"
+#include "config.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/* a directory fd shared by its queued subdirectories */
+typedef struct walk_parent {
+	int fd;
+	int refs;
+} walk_parent;
+
+typedef struct walk_dir_t {
+	walk_parent* parent;  /** NULL for roots, or if dup(2) failed */
+	size_t nameoff;       /** of the name within path */
+	char path[];
+} walk_dir_t;
+
+typedef struct walk_deque {
+	pthread_mutex_t lock;
+	walk_dir_t** dirv;  /** directories in [head, tail) */
+	size_t head;
+	size_t tail;
+	size_t size;
+} walk_deque;
+
+typedef struct walk_state {
+	walk_file_fn fn;
+
+	walk_deque dequev[MAX_JOBS];
+	int dequec;
+
+	pthread_mutex_t lock;
+	pthread_cond_t more;     /** signaled when work is pushed, or when done */
+	size_t pending;          /** directories queued or being read           */
+	long queued;             /** directories in the deques                  */
+	int idle;                /** threads waiting on more                    */
+} walk_state;
+
+#ifdef STATX_TYPE
+static int statx_works = 1;
+
+static unsigned walk_stat_mask() { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	int methods = cfg->discriminantv[0].methods;
+	unsigned mask = STATX_TYPE | STATX_INO | STATX_SIZE; /* dev comes for free */
+
+	if ((methods & DISC_MTIME) || cfg->minage)
+		mask |= STATX_MTIME;
+
+	if (methods & DISC_USER)
+		mask |= STATX_UID;
+
+	if (methods & DISC_GROUP)
+		mask |= STATX_GID;
+
+	if (methods & DISC_PERMS)
+		mask |= STATX_MODE;
+
+	/* catalog records are checked against both */
+	if (cfg->catalog)
+		mask |= STATX_MTIME | STATX_CTIME;
+
+	return mask;
+} // }}}
+#endif
+
+int walk_stat(int dfd, const char* name, struct stat* st) { // {{{
+
+#ifdef STATX_TYPE
+	CACHED_CONFIG(cfg);
+
+	static unsigned mask = 0;
+	if (!mask)
+		mask = walk_stat_mask();
+
+	if (statx_works) {
+		struct statx stx;
+		int flags = AT_SYMLINK_NOFOLLOW;
+
+		if (cfg->flags & CONFIG_STAT_DONT_SYNC)
+			flags |= AT_STATX_DONT_SYNC;
+
+		if (statx(dfd, name, flags, mask, &stx) == 0) {
+			memset(st, 0, sizeof(*st));
+			st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+			st->st_ino = stx.stx_ino;
+			st->st_mode = stx.stx_mode;
+			st->st_nlink = stx.stx_nlink;
+			st->st_uid = stx.stx_uid;
+			st->st_gid = stx.stx_gid;
+			st->st_size = stx.stx_size;
+			st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+			st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+			st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+			st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+			return 0;
+		}
+
+		if (errno != ENOSYS)
+			return -1;
+
+		statx_works = 0;
+	}
+#endif
+
+	return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+} // }}}
+
+static char** rootv = NULL;
+static int rootc = 0;
+
+static walk_state _ws;
+
+static walk_dir_t* walk_dir_new(walk_parent* parent, const char* path, size_t plen, const char* name) { // {{{
+
+	size_t nlen = strlen(name) + 1;
+	walk_dir_t* d = (walk_dir_t*)malloc(sizeof(*d) + plen + nlen);
+
+	d->parent = parent;
+	d->nameoff = plen;
+	memcpy(d->path, path, plen);
+	memcpy(d->path + plen, name, nlen);
+
+	if (parent)
+		__atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+
+	return d;
+} // }}}
+
+static void walk_parent_release(walk_parent* parent) { // {{{
+	if (parent && !__atomic_sub_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL)) {
+		close(parent->fd);
+		free(parent);
+	}
+} // }}}
+
+static void walk_dir_free(walk_dir_t* d) { // {{{
+	walk_parent_release(d->parent);
+	free(d);
+} // }}}
+
+void walk_add(const char* path) { // {{{
+	rootv = realloc(rootv, ++rootc * sizeof(rootv[0]));
+	rootv[rootc-1] = strdup(path);
+} // }}}
+
+static void deque_init(walk_deque* dq) { // {{{
+	pthread_mutex_init(&dq->lock, NULL);
+	dq->dirv = NULL;
+	dq->head = dq->tail = dq->size = 0;
+} // }}}
+
+static void deque_destroy(walk_deque* dq) { // {{{
+	assert(dq->head == dq->tail);
+	free(dq->dirv);
+	pthread_mutex_destroy(&dq->lock);
+} // }}}
+
+static void deque_push(walk_deque* dq, walk_dir_t* dir) { // {{{
+
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail == dq->size) {
+		if (dq->head) {
+			memmove(dq->dirv, dq->dirv + dq->head, (dq->tail - dq->head) * sizeof(dq->dirv[0]));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		}
+
+		if (dq->tail == dq->size) {
+			dq->size = dq->size ? dq->size * 2 : 64;
+			dq->dirv = realloc(dq->dirv, dq->size * sizeof(dq->dirv[0]));
+		}
+	}
+
+	dq->dirv[dq->tail++] = dir;
+
+	pthread_mutex_unlock(&dq->lock);
+} // }}}
+
+/* owner side: newest first, keeps the walk depth first */
+static walk_dir_t* deque_pop(walk_deque* dq) { // {{{
+
+	walk_dir_t* ret = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head)
+		ret = dq->dirv[--dq->tail];
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+} // }}}
+
+/* thief side: oldest first, those are the closest to the root */
+static walk_dir_t* deque_steal(walk_deque* dq) { // {{{
+
+	walk_dir_t* ret = NULL;
+
+	if (pthread_mutex_trylock(&dq->lock))
+		return NULL;
+
+	if (dq->tail > dq->head)
+		ret = dq->dirv[dq->head++];
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+} // }}}
+
+static void walk_queue(int self, walk_dir_t* dir) { // {{{
+
+	pthread_mutex_lock(&_ws.lock);
+	_ws.pending++;
+	pthread_mutex_unlock(&_ws.lock);
+
+	deque_push(&_ws.dequev[self], dir);
+
+	pthread_mutex_lock(&_ws.lock);
+	_ws.queued++;
+	if (_ws.idle)
+		pthread_cond_signal(&_ws.more);
+	pthread_mutex_unlock(&_ws.lock);
+
+} // }}}
+
+static void walk_done() { // {{{
+
+	pthread_mutex_lock(&_ws.lock);
+	if (!--_ws.pending)
+		pthread_cond_broadcast(&_ws.more);
+	pthread_mutex_unlock(&_ws.lock);
+
+} // }}}
+
+/* Subdirectories are opened relative to their parent, so the kernel
+ * doesn't resolve the whole path again for each of them. */
+static void walk_dir(int self, walk_dir_t* dir) { // {{{
+
+	const char* path = dir->path;
+	int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+	int dfd = dir->parent ?
+		openat(dir->parent->fd, path + dir->nameoff, flags) :
+		open(path, flags);
+	DIR* dh = dfd < 0 ? NULL : fdopendir(dfd);
+	walk_parent* parent = NULL;
+
+	if (!dh) {
+		error("Error opening \"%s\": %s\n", path, strerror(errno));
+		if (dfd >= 0)
+			close(dfd);
+		return;
+	}
+
+	/* "<path>/" is written once, each entry name is appended to it */
+	size_t plen = strlen(path);
+	size_t fsize = plen + 256;
+	char* full = (char*)malloc(fsize);
+	memcpy(full, path, plen);
+	full[plen++] = '/';
+
+	struct dirent* de;
+
+	while ((de = readdir(dh))) {
+
+		const char* name = de->d_name;
+
+		if ((name[0] == '.') && (!name[1] || ((name[1] == '.') && !name[2])))
+			continue;
+
+		struct stat st;
+		unsigned char type = de->d_type;
+
+		// symlinks, char/block devices, FIFOs and sockets are ignored
+		// without stat'ing them.
+		if ((type != DT_DIR) && (type != DT_REG) && (type != DT_UNKNOWN))
+			continue;
+
+		if (type != DT_DIR) {
+			if (walk_stat(dfd, name, &st) < 0) {
+				error("Error accessing \"%s/%s\": %s\n", path, name, strerror(errno));
+				continue;
+			}
+
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+
+			else if (!S_ISREG(st.st_mode))
+				continue;
+		}
+
+		size_t nlen = strlen(name) + 1;
+
+		if (type == DT_DIR) {
+			/* on EMFILE and the like, the full path is opened */
+			if (!parent) {
+				int pfd = fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+				if (pfd >= 0) {
+					parent = (walk_parent*)malloc(sizeof(*parent));
+					parent->fd = pfd;
+					parent->refs = 1;
+				}
+			}
+
+			walk_queue(self, walk_dir_new(parent, full, plen, name));
+			continue;
+		}
+
+		if (plen + nlen > fsize) {
+			fsize = plen + nlen;
+			full = (char*)realloc(full, fsize);
+		}
+		memcpy(full + plen, name, nlen);
+
+		_ws.fn(full, &st);
+	}
+
+	/* the queued subdirectories keep their own references */
+	walk_parent_release(parent);
+
+	free(full);
+	closedir(dh);
+
+} // }}}
+
+static walk_dir_t* walk_next(int self) { // {{{
+
+	walk_dir_t* dir = deque_pop(&_ws.dequev[self]);
+	int i = 1;
+
+	for (; !dir && (i < _ws.dequec); ++i)
+		dir = deque_steal(&_ws.dequev[(self + i) % _ws.dequec]);
+
+	return dir;
+} // }}}
+
+static void* walk_worker(void* _self) { // {{{
+
+	int self = (int)(long)_self;
+
+	while (1) {
+
+		walk_dir_t* dir = walk_next(self);
+
+		if (dir) {
+			/* may go below 0 for a while, if taken before counted */
+			pthread_mutex_lock(&_ws.lock);
+			_ws.queued--;
+			pthread_mutex_unlock(&_ws.lock);
+
+			walk_dir(self, dir);
+			walk_done();
+			walk_dir_free(dir);
+			continue;
+		}
+
+		pthread_mutex_lock(&_ws.lock);
+
+		/* Nothing queued: sleep until something is, or the walk is
+		 * over.  Otherwise a deque was skipped because it was locked,
+		 * so try again. */
+		_ws.idle++;
+		while (_ws.pending && (_ws.queued <= 0))
+			pthread_cond_wait(&_ws.more, &_ws.lock);
+		_ws.idle--;
+
+		if (!_ws.pending) {
+			pthread_mutex_unlock(&_ws.lock);
+			break;
+		}
+
+		pthread_mutex_unlock(&_ws.lock);
+	}
+
+	return NULL;
+} // }}}
+
+void walk_run(walk_file_fn fn) { // {{{
+
+	CACHED_CONFIG(cfg);
+
+	pthread_t tidv[MAX_JOBS];
+	int tidc = 0;
+	int iroot = 0;
+
+	_ws.fn = fn;
+	_ws.dequec = cfg->walkers;
+	_ws.pending = 0;
+	_ws.queued = 0;
+	_ws.idle = 0;
+	pthread_mutex_init(&_ws.lock, NULL);
+	pthread_cond_init(&_ws.more, NULL);
+
+	int i = 0;
+	for (; i < _ws.dequec; ++i)
+		deque_init(&_ws.dequev[i]);
+
+	for (; iroot < rootc; ++iroot) {
+
+		char* path = rootv[iroot];
+		struct stat st;
+
+		debug("Processing path %s", path);
+
+		if (walk_stat(AT_FDCWD, path, &st) < 0) {
+			error("Error accessing \"%s\": %s\n", path, strerror(errno));
+			free(path);
+
+		} else if (S_ISDIR(st.st_mode)) {
+			walk_queue(iroot % _ws.dequec, walk_dir_new(NULL, path, 0, path));
+			free(path);
+
+		} else {
+			if (S_ISREG(st.st_mode))
+				fn(path, &st);
+			free(path);
+
+		}
+	}
+
+	free(rootv);
+	rootv = NULL;
+	rootc = 0;
+
+	/* the calling thread is walker 0 */
+	while (tidc < _ws.dequec - 1) {
+		int err = pthread_create(&tidv[tidc], NULL, walk_worker, (void*)(long)(tidc + 1));
+		if (err) {
+			warning("Could not start walker thread: %s.\n", strerror(err));
+			break;
+		}
+		++tidc;
+	}
+
+	walk_worker((void*)0L);
+
+	while (tidc--)
+		pthread_join(tidv[tidc], NULL);
+
+	for (i = 0; i < _ws.dequec; ++i)
+		deque_destroy(&_ws.dequev[i]);
+
+	pthread_cond_destroy(&_ws.more);
+	pthread_mutex_destroy(&_ws.lock);
+
+} // }}}
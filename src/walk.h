@@ -0,0 +1,55 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_WALK_H
+#define __FILEDEDUP_WALK_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*****************************************************
+ *
+ * Directory walker
+ *
+ * Directories are scanned by config()->walkers threads.  Each thread
+ * keeps its own deque of directories still to be read: it pushes and
+ * pops subdirectories at the tail (depth first), and when it runs out
+ * of work it steals from the head of another thread's deque.
+ *
+ * Entries are stat'ed relative to their directory fd (fstatat), and
+ * subdirectories are opened relative to it (openat, through a dup kept
+ * while they are queued).  readdir's d_type is trusted to skip
+ * symlinks, devices and FIFOs without stat'ing them at all.
+ *
+ * walk_file_fn is called (possibly from several threads at once) for
+ * every regular file.  The path is only valid during the call.
+ *
+ */
+
+typedef void (*walk_file_fn)(const char* path, struct stat* st);
+
+/* lstat(2) of dfd-relative name, through statx(2) when available.  Only
+ * the fields needed by the step 0 discriminants (plus type, inode, size
+ * and device) are requested; the other fields of *st are zeroed. */
+int walk_stat(int dfd, const char* name, struct stat* st);
+
+void walk_add(const char* path);   /** queue a path given by the user */
+void walk_run(walk_file_fn fn);    /** walk every queued path         */
+
+#endif
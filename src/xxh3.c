@@ -0,0 +1,521 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "xxh3.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XXH3_X86
+#endif
+
+#define PRIME32_1  0x9E3779B1U
+#define PRIME32_2  0x85EBCA77U
+#define PRIME32_3  0xC2B2AE3DU
+#define PRIME64_1  0x9E3779B185EBCA87ULL
+#define PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3  0x165667B19E3779F9ULL
+#define PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define PRIME64_5  0x27D4EB2F165667C5ULL
+#define PRIME_MX1  0x165667919E3779F9ULL
+#define PRIME_MX2  0x9FB21C651E98DF25ULL
+
+#define STRIPE_LEN          64
+#define SECRET_SIZE        192
+#define SECRET_CONSUME       8  /** secret bytes skipped per stripe    */
+#define SECRET_LIMIT       (SECRET_SIZE - STRIPE_LEN)
+#define STRIPES_PER_BLOCK  (SECRET_LIMIT / SECRET_CONSUME)
+#define SECRET_LASTACC       7
+#define SECRET_MERGEACCS    11
+#define MIDSIZE_MAX        240
+
+static const unsigned char secret[SECRET_SIZE] __attribute__((aligned(64))) = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/*****************************************************
+ *
+ * Helpers
+ *
+ */
+
+static inline uint32_t read32(const unsigned char* p) { // {{{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+} // }}}
+
+static inline uint64_t read64(const unsigned char* p) { // {{{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+} // }}}
+
+static inline uint64_t rotl64(uint64_t v, int r) { // {{{
+	return (v << r) | (v >> (64 - r));
+} // }}}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b) { // {{{
+	unsigned __int128 p = (unsigned __int128)a * b;
+	return (uint64_t)p ^ (uint64_t)(p >> 64);
+} // }}}
+
+static uint64_t xxh64_avalanche(uint64_t h) { // {{{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+} // }}}
+
+static uint64_t avalanche(uint64_t h) { // {{{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+} // }}}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len) { // {{{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return h ^ (h >> 28);
+} // }}}
+
+static inline uint64_t mix16(const unsigned char* in, const unsigned char* key) { // {{{
+	return mul128_fold64(read64(in) ^ read64(key), read64(in + 8) ^ read64(key + 8));
+} // }}}
+
+/*****************************************************
+ *
+ * Up to 240 bytes: hashed straight from the buffer
+ *
+ */
+
+static uint64_t hash_short(const unsigned char* in, size_t len) { // {{{
+
+	if (len > 8) {
+		uint64_t lo = read64(in) ^ (read64(secret + 24) ^ read64(secret + 32));
+		uint64_t hi = read64(in + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+		return avalanche(len + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi));
+	}
+
+	if (len >= 4) {
+		uint64_t v = read32(in + len - 4) + ((uint64_t)read32(in) << 32);
+		return rrmxmx(v ^ (read64(secret + 8) ^ read64(secret + 16)), len);
+	}
+
+	if (len) {
+		uint32_t c = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+			(uint32_t)in[len - 1] | ((uint32_t)len << 8);
+		return xxh64_avalanche(c ^ (uint64_t)(read32(secret) ^ read32(secret + 4)));
+	}
+
+	return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+} // }}}
+
+static uint64_t hash_mid(const unsigned char* in, size_t len) { // {{{
+
+	uint64_t acc = len * PRIME64_1;
+	int i;
+
+	if (len <= 128) {
+		int rounds = (len - 1) / 32;
+		for (i = rounds; i >= 0; --i) {
+			acc += mix16(in + 16 * i, secret + 32 * i);
+			acc += mix16(in + len - 16 * (i + 1), secret + 32 * i + 16);
+		}
+		return avalanche(acc);
+	}
+
+	for (i = 0; i < 8; ++i)
+		acc += mix16(in + 16 * i, secret + 16 * i);
+	acc = avalanche(acc);
+
+	for (i = 8; i < len / 16; ++i)
+		acc += mix16(in + 16 * i, secret + 16 * (i - 8) + 3);
+
+	acc += mix16(in + len - 16, secret + 136 - 17);
+	return avalanche(acc);
+} // }}}
+
+/*****************************************************
+ *
+ * Stripe kernels: each 64 byte stripe is folded into 8 accumulators,
+ * which get scrambled at the end of every block of 16 stripes.
+ *
+ */
+
+typedef void (*accumulate_fn)(uint64_t* acc, const unsigned char* in, const unsigned char* key, size_t stripes);
+typedef void (*scramble_fn)(uint64_t* acc, const unsigned char* key);
+
+static void accumulate_scalar(uint64_t* acc, const unsigned char* in, const unsigned char* key, size_t stripes) { // {{{
+
+	for (; stripes; --stripes, in += STRIPE_LEN, key += SECRET_CONSUME) {
+		int i;
+		for (i = 0; i < 8; ++i) {
+			uint64_t v = read64(in + 8 * i);
+			uint64_t k = v ^ read64(key + 8 * i);
+			acc[i ^ 1] += v;
+			acc[i] += (k & 0xffffffff) * (k >> 32);
+		}
+	}
+
+} // }}}
+
+static void scramble_scalar(uint64_t* acc, const unsigned char* key) { // {{{
+
+	int i;
+	for (i = 0; i < 8; ++i) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= read64(key + 8 * i);
+		acc[i] = a * PRIME32_1;
+	}
+
+} // }}}
+
+#ifdef XXH3_X86
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t* acc, const unsigned char* in, const unsigned char* key, size_t stripes) { // {{{
+
+	__m128i* a = (__m128i*)acc;
+	int i;
+
+	for (; stripes; --stripes, in += STRIPE_LEN, key += SECRET_CONSUME) {
+		for (i = 0; i < 4; ++i) {
+			__m128i v = _mm_loadu_si128((const __m128i*)in + i);
+			__m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)key + i));
+			__m128i p = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+			__m128i s = _mm_add_epi64(_mm_loadu_si128(a + i), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+			_mm_storeu_si128(a + i, _mm_add_epi64(p, s));
+		}
+	}
+
+} // }}}
+
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t* acc, const unsigned char* key) { // {{{
+
+	__m128i* a = (__m128i*)acc;
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128(a + i);
+		v = _mm_xor_si128(v, _mm_srli_epi64(v, 47));
+		v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)key + i));
+		__m128i lo = _mm_mul_epu32(v, prime);
+		__m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+		_mm_storeu_si128(a + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+	}
+
+} // }}}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const unsigned char* in, const unsigned char* key, size_t stripes) { // {{{
+
+	__m256i* a = (__m256i*)acc;
+	int i;
+
+	for (; stripes; --stripes, in += STRIPE_LEN, key += SECRET_CONSUME) {
+		for (i = 0; i < 2; ++i) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)in + i);
+			__m256i k = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)key + i));
+			__m256i p = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+			__m256i s = _mm256_add_epi64(_mm256_loadu_si256(a + i), _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+			_mm256_storeu_si256(a + i, _mm256_add_epi64(p, s));
+		}
+	}
+
+} // }}}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t* acc, const unsigned char* key) { // {{{
+
+	__m256i* a = (__m256i*)acc;
+	const __m256i prime = _mm256_set1_epi32(PRIME32_1);
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		__m256i v = _mm256_loadu_si256(a + i);
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 47));
+		v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)key + i));
+		__m256i lo = _mm256_mul_epu32(v, prime);
+		__m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+		_mm256_storeu_si256(a + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+	}
+
+} // }}}
+
+__attribute__((target("avx512f")))
+static void accumulate_avx512(uint64_t* acc, const unsigned char* in, const unsigned char* key, size_t stripes) { // {{{
+
+	__m512i a = _mm512_loadu_si512(acc);
+
+	for (; stripes; --stripes, in += STRIPE_LEN, key += SECRET_CONSUME) {
+		__m512i v = _mm512_loadu_si512(in);
+		__m512i k = _mm512_xor_si512(v, _mm512_loadu_si512(key));
+		__m512i p = _mm512_mul_epu32(k, _mm512_shuffle_epi32(k, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 3, 0, 1)));
+		__m512i s = _mm512_add_epi64(a, _mm512_shuffle_epi32(v, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2)));
+		a = _mm512_add_epi64(p, s);
+	}
+
+	_mm512_storeu_si512(acc, a);
+
+} // }}}
+
+__attribute__((target("avx512f")))
+static void scramble_avx512(uint64_t* acc, const unsigned char* key) { // {{{
+
+	const __m512i prime = _mm512_set1_epi32(PRIME32_1);
+	__m512i a = _mm512_loadu_si512(acc);
+
+	/* 0x96: a ^ b ^ c */
+	__m512i v = _mm512_ternarylogic_epi32(a, _mm512_srli_epi64(a, 47), _mm512_loadu_si512(key), 0x96);
+	__m512i lo = _mm512_mul_epu32(v, prime);
+	__m512i hi = _mm512_mul_epu32(_mm512_shuffle_epi32(v, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 3, 0, 1)), prime);
+
+	_mm512_storeu_si512(acc, _mm512_add_epi64(lo, _mm512_slli_epi64(hi, 32)));
+
+} // }}}
+
+#endif
+
+static struct {
+	const char* name;
+	accumulate_fn accumulate;
+	scramble_fn scramble;
+} _kernel = { "scalar", accumulate_scalar, scramble_scalar };
+
+static pthread_once_t _kernel_once = PTHREAD_ONCE_INIT;
+
+static void kernel_select() { // {{{
+#ifdef XXH3_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		_kernel.name = "avx512";
+		_kernel.accumulate = accumulate_avx512;
+		_kernel.scramble = scramble_avx512;
+
+	} else if (__builtin_cpu_supports("avx2")) {
+		_kernel.name = "avx2";
+		_kernel.accumulate = accumulate_avx2;
+		_kernel.scramble = scramble_avx2;
+
+	} else if (__builtin_cpu_supports("sse2")) {
+		_kernel.name = "sse2";
+		_kernel.accumulate = accumulate_sse2;
+		_kernel.scramble = scramble_sse2;
+	}
+#endif
+} // }}}
+
+const char* xxh3_kernel() { // {{{
+	pthread_once(&_kernel_once, kernel_select);
+	return _kernel.name;
+} // }}}
+
+int xxh3_set_kernel(const char* name) { // {{{
+
+	pthread_once(&_kernel_once, kernel_select);
+
+	if (!strcmp(name, "scalar")) {
+		_kernel.name = "scalar";
+		_kernel.accumulate = accumulate_scalar;
+		_kernel.scramble = scramble_scalar;
+		return 1;
+	}
+
+#ifdef XXH3_X86
+	if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		_kernel.name = "sse2";
+		_kernel.accumulate = accumulate_sse2;
+		_kernel.scramble = scramble_sse2;
+		return 1;
+	}
+
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		_kernel.name = "avx2";
+		_kernel.accumulate = accumulate_avx2;
+		_kernel.scramble = scramble_avx2;
+		return 1;
+	}
+
+	if (!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f")) {
+		_kernel.name = "avx512";
+		_kernel.accumulate = accumulate_avx512;
+		_kernel.scramble = scramble_avx512;
+		return 1;
+	}
+#endif
+
+	return 0;
+} // }}}
+
+/*****************************************************
+ *
+ * Streaming
+ *
+ */
+
+/* Feeds stripes to the accumulators, scrambling at each block end */
+static void consume_stripes(uint64_t* acc, size_t* sofar, const unsigned char* in, size_t stripes) { // {{{
+
+	while (stripes) {
+		size_t n = STRIPES_PER_BLOCK - *sofar;
+		if (n > stripes)
+			n = stripes;
+
+		_kernel.accumulate(acc, in, secret + *sofar * SECRET_CONSUME, n);
+		in += n * STRIPE_LEN;
+		stripes -= n;
+		*sofar += n;
+
+		if (*sofar == STRIPES_PER_BLOCK) {
+			_kernel.scramble(acc, secret + SECRET_LIMIT);
+			*sofar = 0;
+		}
+	}
+
+} // }}}
+
+void xxh3_init(xxh3_state_t* s) { // {{{
+
+	static const uint64_t acc0[8] = {
+		PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+		PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+	};
+
+	pthread_once(&_kernel_once, kernel_select);
+
+	memcpy(s->acc, acc0, sizeof(acc0));
+	s->buffered = 0;
+	s->stripes = 0;
+	s->total = 0;
+
+} // }}}
+
+void xxh3_update(xxh3_state_t* s, const void* b, size_t len) { // {{{
+
+	const unsigned char* in = (const unsigned char*)b;
+	const unsigned char* end = in + len;
+
+	s->total += len;
+
+	if (len <= XXH3_BUFFER_SIZE - s->buffered) {
+		memcpy(s->buffer + s->buffered, in, len);
+		s->buffered += len;
+		return;
+	}
+
+	/* The last stripe is always kept in the buffer: it is hashed
+	 * differently by xxh3_final() */
+	if (s->buffered) {
+		size_t fill = XXH3_BUFFER_SIZE - s->buffered;
+		memcpy(s->buffer + s->buffered, in, fill);
+		in += fill;
+		consume_stripes(s->acc, &s->stripes, s->buffer, XXH3_BUFFER_SIZE / STRIPE_LEN);
+		s->buffered = 0;
+	}
+
+	if (end - in > XXH3_BUFFER_SIZE) {
+		size_t stripes = (end - 1 - in) / STRIPE_LEN;
+		consume_stripes(s->acc, &s->stripes, in, stripes);
+		in += stripes * STRIPE_LEN;
+		/* xxh3_final() may need the stripe before the tail */
+		memcpy(s->buffer + XXH3_BUFFER_SIZE - STRIPE_LEN, in - STRIPE_LEN, STRIPE_LEN);
+	}
+
+	memcpy(s->buffer, in, end - in);
+	s->buffered = end - in;
+
+} // }}}
+
+static uint64_t digest_long(const xxh3_state_t* s) { // {{{
+
+	uint64_t acc[8] __attribute__((aligned(64)));
+	unsigned char last[STRIPE_LEN];
+	const unsigned char* plast = last;
+	size_t sofar = s->stripes;
+	int i;
+
+	memcpy(acc, s->acc, sizeof(acc));
+
+	if (s->buffered >= STRIPE_LEN) {
+		consume_stripes(acc, &sofar, s->buffer, (s->buffered - 1) / STRIPE_LEN);
+		plast = s->buffer + s->buffered - STRIPE_LEN;
+
+	} else {
+		size_t catchup = STRIPE_LEN - s->buffered;
+		memcpy(last, s->buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+		memcpy(last + catchup, s->buffer, s->buffered);
+	}
+
+	_kernel.accumulate(acc, plast, secret + SECRET_LIMIT - SECRET_LASTACC, 1);
+
+	uint64_t h = s->total * PRIME64_1;
+	for (i = 0; i < 4; ++i)
+		h += mul128_fold64(acc[2 * i] ^ read64(secret + SECRET_MERGEACCS + 16 * i),
+			acc[2 * i + 1] ^ read64(secret + SECRET_MERGEACCS + 16 * i + 8));
+
+	return avalanche(h);
+} // }}}
+
+void xxh3_final(const xxh3_state_t* s, unsigned char out[XXH3_DIGEST_LENGTH]) { // {{{
+
+	uint64_t h;
+	int i;
+
+	if (s->total > MIDSIZE_MAX)
+		h = digest_long(s);
+	else if (s->total > 16)
+		h = hash_mid(s->buffer, s->total);
+	else
+		h = hash_short(s->buffer, s->total);
+
+	/* canonical form, as printed by xxhsum */
+	for (i = XXH3_DIGEST_LENGTH - 1; i >= 0; --i, h >>= 8)
+		out[i] = h & 0xff;
+
+} // }}}
@@ -0,0 +1,55 @@
+/*
+       This file is part of Filededup, a file deduplication program.
+       Copyright (C) 2014 Gonzalo Arana <gonzalo.arana@gmail.com>
+       
+       Filededup is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       
+       Filededup is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+       
+       You should have received a copy of the GNU General Public License
+       along with Filededup.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __FILEDEDUP_XXH3_H
+#define __FILEDEDUP_XXH3_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*****************************************************
+ *
+ * XXH3 64 bits (seed 0, default secret), streaming.  Not cryptographic:
+ * meant for the prefix and intermediate steps, leaving the final one to
+ * a cryptographic digest (or --eval=compare).
+ *
+ * The stripe kernels are picked at run time (AVX-512, AVX2, SSE2 or
+ * plain C).  The output matches the reference XXH3_64bits().
+ *
+ */
+
+#define XXH3_DIGEST_LENGTH   8
+#define XXH3_BUFFER_SIZE   256
+
+typedef struct xxh3_state_t {
+	uint64_t acc[8];
+	unsigned char buffer[XXH3_BUFFER_SIZE];
+	size_t buffered;   /** bytes in buffer              */
+	size_t stripes;    /** stripes of the current block */
+	uint64_t total;    /** bytes fed so far             */
+} xxh3_state_t;
+
+void xxh3_init(xxh3_state_t* s);
+void xxh3_update(xxh3_state_t* s, const void* b, size_t len);
+void xxh3_final(const xxh3_state_t* s, unsigned char out[XXH3_DIGEST_LENGTH]);  /** big endian, s is left alone */
+
+const char* xxh3_kernel();  /** name of the stripe kernel in use */
+int xxh3_set_kernel(const char* name);  /** for tests: 0 if not supported by this CPU */
+
+#endif